@@ -0,0 +1,176 @@
+/**\file
+ * \brief	Замеры производительности эмулятора AY и секвенсора CPS.
+ *
+ *  Запускается без звукового устройства: make bench [CC=clang] [DEFINES=-mavx2].
+ *  Параметр — частота дискретизации (по умолчанию 48000 Гц).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ay.h"
+#include "cps.h"
+
+static const struct ay_timeline music_game =
+#include "../music/music16.cps.inl"
+;
+
+enum {
+	/// Минимальная длительность замера, нс.
+	min_duration	= 300000000,
+	/// Кадров, синтезируемых до замера.
+	warmup_frames	= 50,
+};
+
+/** Состояния регистров, характерные для композиций. */
+static const struct {
+	const char    	*name;
+	struct ay_regs	regs;
+} states[] = {
+	{ "тон", {
+		.tone   = { 0x1AC, 0x0D6, 0x06B },
+		.mixer  = 070,
+		.volume = { 15, 12, 10 },
+		.shape  = ay_shape_keep,
+	} },
+	{ "шум", {
+		.noise  = 1,
+		.mixer  = 007,
+		.volume = { 15, 12, 10 },
+		.shape  = ay_shape_keep,
+	} },
+	{ "огибающая", {
+		.mixer    = 077,
+		.volume   = { 0x10, 0x10, 0x10 },
+		.envelope = 1,
+		.shape    = 0x0E,
+	} },
+	{ "все каналы", {
+		.tone     = { 0x1AC, 0x11D, 0x06B },
+		.noise    = 3,
+		.mixer    = 020,
+		.volume   = { 15, 0x10, 0x10 },
+		.envelope = 16,
+		.shape    = 0x08,
+	} },
+};
+
+static const char *const synthesis_name[] = {
+	[ay_synth_ticks]  = "ticks",
+	[ay_synth_events] = "events",
+	[ay_synth_blep]   = "blep",
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, const char *mode, double ns, unsigned long frames)
+{
+	// Ширина поля printf() учитывает байты, а не символы UTF-8.
+	int width = 16;
+	for (const char *c = name; *c; ++c)
+		width += (*c & 0xC0) == 0x80;
+	printf("%-*s %-7s %9.2f нс/дискр. %11.0f нс/кадр\n", width, name, mode,
+	       ns / (frames * (double)chunk_size), ns / frames);
+}
+
+/** Синтез кадров при неизменных регистрах. */
+static void bench_state(const struct ay_regs *regs, const char *name, lr32 *out)
+{
+	struct ay ay;
+	ay_create(&ay);
+	ay_write(&ay, regs);
+	for (int f = 0; f < warmup_frames; ++f)
+		ay_make_chunk(&ay, out);
+	unsigned long frames = 0;
+	const double start = now();
+	double ns;
+	do {
+		for (int f = 0; f < warmup_frames; ++f)
+			ay_make_chunk(&ay, out);
+		frames += warmup_frames;
+	} while ((ns = now() - start) < min_duration);
+	report(name, synthesis_name[synthesis], ns, frames);
+	ay_destroy(&ay);
+}
+
+/**
+ * Воспроизведение встроенной композиции: выборка регистров и синтез.
+ * При chips > 1 каждый процессор воспроизводит её со сдвигом на кадр.
+ */
+static void bench_music(const struct ay_timeline *tl, unsigned chips, lr32 *out)
+{
+	struct ay ay;
+	ay_create(&ay);
+	ay_set_chips(&ay, chips);
+	unsigned long frames = 0;
+	const double start = now();
+	double ns;
+	do {
+		for (unsigned f = 0; f < tl->frames; ++f) {
+			for (unsigned c = 0; c < chips; ++c) {
+				struct ay_regs regs;
+				ay_timeline_regs(tl, (f + c) % tl->frames, &regs);
+				ay_write_chip(&ay, c, &regs);
+			}
+			ay_make_chunk(&ay, out);
+		}
+		frames += tl->frames;
+	} while ((ns = now() - start) < min_duration);
+	char name[32];
+	snprintf(name, sizeof(name), chips > 1 ? "music_game ×%u" : "music_game", chips);
+	report(name, synthesis_name[synthesis], ns, frames);
+	ay_destroy(&ay);
+}
+
+/** Разбор шаблонов, сэмплов и орнаментов композиции секвенсором. */
+static void bench_sequencer(const char *path)
+{
+	FILE *in = fopen(path, "rb");
+	if (!in) {
+		perror(path);
+		return;
+	}
+	static uint8_t data[0x10000];
+	const size_t size = fread(data, 1, sizeof(data), in);
+	fclose(in);
+	unsigned long frames = 0;
+	const double start = now();
+	double ns;
+	do {
+		struct ay_timeline tl;
+		if (!size || !cps_compile(data, size, &tl)) {
+			fprintf(stderr, "Композиция %s не скомпилирована.\n", path);
+			return;
+		}
+		frames += tl.frames;
+		cps_timeline_free(&tl);
+	} while ((ns = now() - start) < min_duration);
+	report("секвенсор CPS", "-", ns, frames);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		sample_rate = atoi(argv[1]);
+	ay_setup();
+	lr32 *out = malloc(chunk_size * sizeof(*out));
+	printf("Частота %u Гц, %u дискретизаций в кадре.\n", sample_rate, chunk_size);
+	for (int i = 0; i < sizeof(states)/sizeof(*states); ++i) {
+		for (synthesis = ay_synth_ticks; synthesis <= ay_synth_blep; ++synthesis)
+			bench_state(&states[i].regs, states[i].name, out);
+	}
+	for (unsigned chips = 1; chips <= ay_max_chips; chips *= 2)
+		for (synthesis = ay_synth_ticks; synthesis <= ay_synth_blep; ++synthesis)
+			bench_music(&music_game, chips, out);
+	bench_sequencer("music/music16.cps");
+	free(out);
+	return 0;
+}
@@ -0,0 +1,195 @@
+/**\file
+ * \brief	Проверка совпадения результатов способов синтеза эмулятора AY.
+ *
+ *  Запускается без звукового устройства: make check [DEFINES=-mavx2].
+ *  Встроенная композиция и характерные состояния регистров синтезируются
+ *  на 1–4 процессорах всеми способами. Проверяется, что:
+ *  - ay_synth_events побитно совпадает с ay_synth_ticks;
+ *  - кадр, сформированный частями произвольной длины, совпадает с целым;
+ *  - состояние процессоров после ay_skip_frame() и любого способа синтеза
+ *    одинаково.
+ *  Параметр — частота дискретизации (по умолчанию 48000 Гц).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ay.h"
+#include "cps.h"
+
+static const struct ay_timeline music_game =
+#include "../music/music16.cps.inl"
+;
+
+enum {
+	/// Кадров композиции, проверяемых для каждого количества процессоров.
+	music_frames	= 500,
+	/// Кадров каждого состояния регистров.
+	state_frames	= 50,
+	/// Сдвиг композиции на каждом следующем процессоре, кадров.
+	chip_shift  	= 37,
+	/// Каждый такой кадр пропускается эмулятором ay_skip_frame().
+	skip_period 	= 3,
+};
+
+/** Состояния регистров, в которых синтез идёт по разным веткам. */
+static const struct ay_regs states[] = {
+	{ .tone = { 0x1AC, 0x0D6, 0x06B }, .mixer = 070, .volume = { 15, 12, 10 },
+	  .shape = ay_shape_keep },
+	{ .tone = { 1, 0, 2 }, .mixer = 070, .volume = { 15, 15, 15 }, .shape = ay_shape_keep },
+	{ .noise = 1, .mixer = 007, .volume = { 15, 12, 10 }, .shape = ay_shape_keep },
+	{ .mixer = 077, .volume = { 0x10, 0x10, 0x10 }, .envelope = 1, .shape = 0x0E },
+	{ .mixer = 077, .volume = { 0x10, 0, 0x10 }, .envelope = 0, .shape = 0x0A },
+	{ .tone = { 0x1AC, 0x11D, 0x06B }, .noise = 3, .mixer = 020,
+	  .volume = { 15, 0x10, 0x10 }, .envelope = 16, .shape = 0x08 },
+	{ .tone = { 0xFFF, 0x003, 0x080 }, .noise = 31, .mixer = 052,
+	  .volume = { 0x10, 7, 0 }, .envelope = 0xFFFF, .shape = 0x0D },
+	{ .mixer = 077, .shape = ay_shape_keep },
+};
+
+static const char *const synthesis_name[] = {
+	[ay_synth_ticks]  = "ticks",
+	[ay_synth_events] = "events",
+	[ay_synth_blep]   = "blep",
+};
+
+/**
+ * Эмуляторы, синтезирующие одни и те же кадры: целиком и частями каждым
+ * способом, а также пропускающий часть кадров.
+ */
+static struct ay	whole[ay_synth_blep + 1], split[ay_synth_blep + 1], skip;
+static lr32     	*whole_out[ay_synth_blep + 1], *split_out;
+static unsigned 	failures;
+
+/** Генератор псевдослучайных границ частей кадра (повторяемый). */
+static unsigned random_next(void)
+{
+	static uint32_t x = 2463534242;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+/** Формирует кадр частями: короткими (до двух блоков смесителя) и длинными. */
+static void make_split(struct ay *ay, lr32 *out)
+{
+	for (unsigned from = 0, to; from < chunk_size; from = to) {
+		const unsigned r = random_next();
+		const unsigned limit = r & 1 ? 2 * mix_block : chunk_size;
+		to = from + 1 + (r >> 1) % limit;
+		if (to > chunk_size)
+			to = chunk_size;
+		ay_make_samples(ay, &out[from], from, to);
+	}
+}
+
+static void fail(const char *what, enum ay_synthesis mode, unsigned chips, unsigned frame)
+{
+	if (failures++ < 10)
+		printf("Не совпадает %s (%s, процессоров %u, кадр %u).\n",
+		       what, synthesis_name[mode], chips, frame);
+}
+
+/** Записывает регистры во все эмуляторы и сравнивает результат кадра. */
+static void check_frame(const struct ay_regs *regs, unsigned chips, unsigned frame)
+{
+	for (enum ay_synthesis m = ay_synth_ticks; m <= ay_synth_blep; ++m) {
+		for (unsigned c = 0; c < chips; ++c) {
+			ay_write_chip(&whole[m], c, &regs[c]);
+			ay_write_chip(&split[m], c, &regs[c]);
+		}
+	}
+	for (unsigned c = 0; c < chips; ++c)
+		ay_write_chip(&skip, c, &regs[c]);
+
+	for (enum ay_synthesis m = ay_synth_ticks; m <= ay_synth_blep; ++m) {
+		synthesis = m;
+		ay_make_chunk(&whole[m], whole_out[m]);
+		make_split(&split[m], split_out);
+		if (memcmp(split_out, whole_out[m], chunk_size * sizeof(*split_out)))
+			fail("кадр по частям", m, chips, frame);
+		if (memcmp(split[m].chip, whole[ay_synth_ticks].chip, chips * sizeof(*skip.chip)))
+			fail("состояние после кадра по частям", m, chips, frame);
+		if (memcmp(whole[m].chip, whole[ay_synth_ticks].chip, chips * sizeof(*skip.chip)))
+			fail("состояние после кадра", m, chips, frame);
+	}
+	if (memcmp(whole_out[ay_synth_events], whole_out[ay_synth_ticks],
+	           chunk_size * sizeof(*split_out)))
+		fail("звук с ticks", ay_synth_events, chips, frame);
+
+	synthesis = frame % (ay_synth_blep + 1);
+	if (frame % skip_period)
+		ay_make_chunk(&skip, split_out);
+	else
+		ay_skip_frame(&skip);
+	if (memcmp(skip.chip, whole[ay_synth_ticks].chip, chips * sizeof(*skip.chip)))
+		fail("состояние после пропуска кадра", synthesis, chips, frame);
+}
+
+static void create_all(unsigned chips)
+{
+	for (enum ay_synthesis m = ay_synth_ticks; m <= ay_synth_blep; ++m) {
+		ay_create(&whole[m]);
+		ay_create(&split[m]);
+		ay_set_chips(&whole[m], chips);
+		ay_set_chips(&split[m], chips);
+	}
+	ay_create(&skip);
+	ay_set_chips(&skip, chips);
+}
+
+static void destroy_all(void)
+{
+	for (enum ay_synthesis m = ay_synth_ticks; m <= ay_synth_blep; ++m) {
+		ay_destroy(&whole[m]);
+		ay_destroy(&split[m]);
+	}
+	ay_destroy(&skip);
+}
+
+/**
+ * Встроенная композиция, каждый процессор со своим сдвигом, затем
+ * состояния регистров, на каждом процессоре своё.
+ */
+static void check_chips(unsigned chips)
+{
+	create_all(chips);
+	unsigned frame = 0;
+	struct ay_regs regs[ay_max_chips];
+	for (unsigned f = 0; f < music_frames; ++f, ++frame) {
+		for (unsigned c = 0; c < chips; ++c)
+			ay_timeline_regs(&music_game, (f + c * chip_shift) % music_game.frames, &regs[c]);
+		check_frame(regs, chips, frame);
+	}
+	const unsigned count = sizeof(states)/sizeof(*states);
+	for (unsigned s = 0; s < count; ++s) {
+		for (unsigned c = 0; c < chips; ++c)
+			regs[c] = states[(s + c) % count];
+		for (unsigned f = 0; f < state_frames; ++f, ++frame) {
+			check_frame(regs, chips, frame);
+			// Форма огибающей записывается только в первом кадре состояния.
+			for (unsigned c = 0; c < chips; ++c)
+				regs[c].shape = ay_shape_keep;
+		}
+	}
+	destroy_all();
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		sample_rate = atoi(argv[1]);
+	ay_setup();
+	for (enum ay_synthesis m = ay_synth_ticks; m <= ay_synth_blep; ++m)
+		whole_out[m] = malloc(chunk_size * sizeof(*whole_out[m]));
+	split_out = malloc(chunk_size * sizeof(*split_out));
+	for (unsigned chips = 1; chips <= ay_max_chips; ++chips)
+		check_chips(chips);
+	printf("Частота %u Гц: %s.\n", sample_rate, failures ? "ОШИБКА" : "результаты совпадают");
+	for (enum ay_synthesis m = ay_synth_ticks; m <= ay_synth_blep; ++m)
+		free(whole_out[m]);
+	free(split_out);
+	return failures != 0;
+}
@@ -0,0 +1,318 @@
+/**\file
+ * \brief	Вывод звука на устройство ALSA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <alsa/asoundlib.h>
+
+#include "audio_stats.h"
+#include "sink.h"
+
+enum {
+	chunks	= 2, ///< Количество фрагментов в буфере звука.
+	/// Дискретизаций, преобразуемых в формат устройства за раз.
+	convert_size	= 1024,
+};
+
+static_assert(channels == 2, "Поддерживается только стереозвук.");
+
+/// Форматы ALSA в порядке предпочтения: S16 выводится без преобразования.
+static const snd_pcm_format_t formats[sample_formats] = {
+	[sample_s16]  	= SND_PCM_FORMAT_S16,
+	[sample_s32]  	= SND_PCM_FORMAT_S32,
+	[sample_float]	= SND_PCM_FORMAT_FLOAT,
+};
+
+static snd_pcm_t *pcm = NULL;
+
+static unsigned int     	period_time;
+static unsigned int     	buffer_time;
+/// Период устройства, может отличаться от period_size.
+static snd_pcm_uframes_t	device_period;
+static snd_pcm_uframes_t	buffer_size; ///< Внутренний буфер
+/// Кольцевой буфер устройства отображён в память (SND_PCM_ACCESS_MMAP_INTERLEAVED).
+static bool             	pcm_mmap;
+
+/**
+ * Выбирает формат вывода: заданный явно, либо первый из поддерживаемых
+ * устройством. \return результат snd_pcm_hw_params_set_format().
+ */
+static int pcm_format(snd_pcm_hw_params_t *hwparams)
+{
+	if (!sample_format_fixed)
+		for (int f = 0; f < sample_formats; ++f)
+			if (snd_pcm_hw_params_test_format(pcm, hwparams, formats[f]) >= 0) {
+				sample_format = f;
+				break;
+			}
+	return snd_pcm_hw_params_set_format(pcm, hwparams, formats[sample_format]);
+}
+
+// В случае PulseAudio устройство "hw" не выводит звук, а для "default"
+// заявляются все возможные форматы и частоты. Что бы избежать
+// передискретизации и преобразования формата сервером или модулем plug,
+// выбираем формат и частоту для "hw" и задаём их для "default".
+static int pcm_init(const char *arg, unsigned period)
+{
+	int r, dir = 0;
+	period_time = period;
+	buffer_time = chunks * period;
+	snd_pcm_hw_params_t *hwparams;
+	snd_pcm_hw_params_alloca(&hwparams);
+	static const char *const devs[3] = { "hw", "default", "pulse" };
+	// Устройство, заданное параметром, открываем без перебора.
+	const char *const *dev = arg ? &arg : devs;
+	const int count = arg ? 1 : sizeof(devs)/sizeof(*devs);
+	for (int i = 0; i < count; ++i) {
+		snd_pcm_t *pcm0 = pcm;
+		r = snd_pcm_open(&pcm, dev[i], SND_PCM_STREAM_PLAYBACK, 0);
+		if (r >= 0) {
+			if (i == 1 && pcm0)
+				snd_pcm_close(pcm0);
+			snd_pcm_hw_params_any(pcm, hwparams);
+			snd_pcm_hw_params_set_rate_resample(pcm, hwparams, 0);
+			// Предпочитаем запись непосредственно в буфер устройства.
+			pcm_mmap = snd_pcm_hw_params_set_access(pcm, hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED) >= 0;
+			if (!pcm_mmap)
+				snd_pcm_hw_params_set_access(pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED);
+			// Для "default" формат уже выбран по "hw".
+			if (i == 1)
+				snd_pcm_hw_params_set_format(pcm, hwparams, formats[sample_format]);
+			else
+				pcm_format(hwparams);
+			snd_pcm_hw_params_set_channels(pcm, hwparams, channels);
+			snd_pcm_hw_params_set_rate_near(pcm, hwparams, &sample_rate, &dir);
+			snd_pcm_hw_params_set_period_time_near(pcm, hwparams, &period_time, &dir);
+			snd_pcm_hw_params_get_period_size(hwparams, &device_period, &dir);
+			snd_pcm_hw_params_set_buffer_time_near(pcm, hwparams, &buffer_time, &dir);
+			snd_pcm_hw_params_get_buffer_size(hwparams, &buffer_size);
+			r = snd_pcm_hw_params(pcm, hwparams);
+		}
+		if (r >= 0)
+			printf("Звуковое устройство %s: %u канала, %u Гц, %s (буфер %lu дискретизаций, сэмпл %g мс%s).\n",
+			       dev[i], channels, sample_rate, sample_format_names[sample_format],
+			       buffer_size, period_time/1000.0, pcm_mmap ? ", mmap" : "");
+		else
+			printf("Звуковое устройство %s: %s.\n", dev[i], snd_strerror(r));
+		if (i && r >= 0)
+			break;
+	}
+	snd_pcm_sw_params_t *swparams;
+	snd_pcm_sw_params_alloca(&swparams);
+	snd_pcm_sw_params_set_start_threshold(pcm, swparams, device_period);
+	snd_pcm_sw_params_set_avail_min(pcm, swparams, device_period);
+	snd_pcm_sw_params(pcm, swparams);
+	return r;
+}
+
+static void pcm_stop(void)
+{
+	snd_pcm_close(pcm);
+}
+
+/** Восстанавливает поток после ошибки r. */
+static bool pcm_restore(int r)
+{
+	switch (r) {
+	case -ESTRPIPE:
+		while ((r = snd_pcm_resume(pcm)) == -EAGAIN)
+			sleep(1);
+	case -EPIPE:
+		snd_pcm_prepare(pcm);
+	case -EAGAIN:
+		return true;
+	// TODO переинициализировать?
+	case -ENODEV:
+	case -ENOTTY:
+	case -EBADFD:
+	default:
+		sleep(1);
+		return false;
+	}
+}
+
+/**
+ * Восстанавливает поток после ошибки r и учитывает её в статистике.
+ * \return false, если продолжать вывод не имеет смысла.
+ */
+static bool pcm_recover(int r)
+{
+	if (r == -EAGAIN)
+		return true;
+	const int64_t start = audio_stats_now();
+	const bool ok = pcm_restore(r);
+	atomic_fetch_add_explicit(r == -EPIPE ? &audio_stats.xruns
+	                        : r == -ESTRPIPE ? &audio_stats.suspends
+	                        : &audio_stats.errors, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&audio_stats.recover_ns, audio_stats_now() - start,
+	                          memory_order_relaxed);
+	return ok;
+}
+
+/** Учитывает задержку вывода после записи. */
+static void pcm_delay(void)
+{
+	snd_pcm_sframes_t delay;
+	if (snd_pcm_delay(pcm, &delay) >= 0)
+		audio_stats_delay(delay);
+}
+
+/** Записывает size дискретизаций в формате устройства. */
+static bool pcm_write(const void *buff, size_t size)
+{
+	const size_t bytes = sample_bytes(sample_format);
+	while (size > 0) {
+		int r = pcm_mmap ? snd_pcm_mmap_writei(pcm, buff, size)
+		                 : snd_pcm_writei(pcm, buff, size);
+		if (r >= 0) {
+			buff = (const uint8_t*)buff + r * bytes;
+			size -= r;
+			continue;
+		}
+		if (!pcm_recover(r))
+			return false;
+	}
+	return true;
+}
+
+static bool pcm_play_chunk(const lr32 *buff, size_t size)
+{
+	if (sample_format == sample_s16) {
+		if (!pcm_write(buff, size))
+			return false;
+	} else {
+		// Преобразуем частями, по мере записи.
+		static alignas(32) int32_t converted[convert_size][channels];
+		for (size_t done = 0; done < size;) {
+			const size_t n = size - done < convert_size ? size - done : convert_size;
+			sample_convert(converted, &buff[done], n);
+			if (!pcm_write(converted, n))
+				return false;
+			done += n;
+		}
+	}
+	pcm_delay();
+	return true;
+}
+
+/**
+ * Ожидает, пока в буфере устройства освободится место для фрагмента.
+ * Воспроизведение таким образом следует часам звукового устройства.
+ * \return false, если продолжать вывод не имеет смысла.
+ */
+static bool pcm_wait_avail(void)
+{
+	for (;;) {
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+		if (avail >= 0 && avail < period_size)
+			avail = snd_pcm_wait(pcm, -1);
+		else if (avail >= 0)
+			return true;
+		if (avail < 0 && !pcm_recover(avail))
+			return false;
+	}
+}
+
+/// Область буфера устройства, выделенная pcm_chunk_begin().
+static snd_pcm_uframes_t	mmap_offset;
+
+/**
+ * Предоставляет место для фрагмента длиной period_size непосредственно
+ * в буфере устройства, если он отображён в память, имеет формат синтеза
+ * и фрагмент помещается без перехода через край.
+ */
+static lr32 *pcm_chunk_begin(void)
+{
+	if (!pcm_wait_avail() || !pcm_mmap || sample_format != sample_s16)
+		return NULL;
+	const snd_pcm_channel_area_t *area;
+	snd_pcm_uframes_t frames = period_size;
+	int r = snd_pcm_mmap_begin(pcm, &area, &mmap_offset, &frames);
+	if (r < 0)
+		return NULL;
+	if (frames < period_size || area->first || area->step != 8 * sizeof(lr32)) {
+		snd_pcm_mmap_commit(pcm, mmap_offset, 0);
+		return NULL;
+	}
+	return (lr32*)area->addr + mmap_offset;
+}
+
+/**
+ * Запускает поток, когда в буфере накопилось device_period дискретизаций.
+ * Порог snd_pcm_sw_params_set_start_threshold() действует только при записи
+ * (snd_pcm_writei(), snd_pcm_mmap_writei()), но не для snd_pcm_mmap_commit().
+ */
+static bool pcm_start(void)
+{
+	if (snd_pcm_state(pcm) != SND_PCM_STATE_PREPARED)
+		return true;
+	snd_pcm_sframes_t r = snd_pcm_avail_update(pcm);
+	if (r >= 0 && buffer_size - r < device_period)
+		return true;
+	if (r >= 0)
+		r = snd_pcm_start(pcm);
+	return r >= 0 || pcm_recover(r);
+}
+
+/** Передаёт устройству фрагмент, размещённый pcm_chunk_begin(). */
+static bool pcm_chunk_commit(lr32 *buff)
+{
+	snd_pcm_sframes_t r = snd_pcm_mmap_commit(pcm, mmap_offset, period_size);
+	if (r == period_size) {
+		pcm_delay();
+		return pcm_start();
+	}
+	return pcm_recover(r < 0 ? r : -EPIPE);
+}
+
+static void pcm_drop(void)
+{
+	snd_pcm_drop(pcm);
+}
+
+static void pcm_prepare(void)
+{
+	snd_pcm_prepare(pcm);
+}
+
+static int pcm_poll_descriptors(struct pollfd *fds, int space)
+{
+	return snd_pcm_poll_descriptors(pcm, fds, space);
+}
+
+static int pcm_poll_revents(struct pollfd *fds, int count)
+{
+	unsigned short revents = 0;
+	if (snd_pcm_poll_descriptors_revents(pcm, fds, count, &revents) < 0)
+		return 0;
+	if (revents & POLLERR) {
+		const snd_pcm_state_t state = snd_pcm_state(pcm);
+		return pcm_recover(state == SND_PCM_STATE_SUSPENDED ? -ESTRPIPE : -EPIPE) ? 0 : -1;
+	}
+	return !!(revents & POLLOUT);
+}
+
+static long pcm_avail(void)
+{
+	snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+	if (avail < 0)
+		return pcm_recover(avail) ? 0 : -1;
+	return avail;
+}
+
+const struct sink alsa_sink = {
+	.name            	= "alsa",
+	.open            	= pcm_init,
+	.close           	= pcm_stop,
+	.begin           	= pcm_chunk_begin,
+	.commit          	= pcm_chunk_commit,
+	.write           	= pcm_play_chunk,
+	.drop            	= pcm_drop,
+	.prepare         	= pcm_prepare,
+	.poll_descriptors	= pcm_poll_descriptors,
+	.poll_revents    	= pcm_poll_revents,
+	.avail           	= pcm_avail,
+};
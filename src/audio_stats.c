@@ -0,0 +1,77 @@
+/**\file
+ * \brief	Статистика вывода звука.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "audio_stats.h"
+#include "ay.h"
+
+struct audio_stats audio_stats;
+
+/** Номер интервала для значения us. */
+static unsigned histogram_bin(uint32_t us)
+{
+	if (us < histogram_exact)
+		return us;
+	const int e = 31 - __builtin_clz(us);
+	return histogram_exact + (e - 5) * 16 + (us >> (e - 4) & 15);
+}
+
+/** Нижняя граница интервала bin. */
+static uint32_t histogram_value(unsigned bin)
+{
+	if (bin < histogram_exact)
+		return bin;
+	const int e = (bin - histogram_exact) / 16 + 5;
+	return (16 + (bin - histogram_exact) % 16) << (e - 4);
+}
+
+void histogram_add(struct histogram *h, uint32_t us)
+{
+	atomic_fetch_add_explicit(&h->bin[histogram_bin(us)], 1, memory_order_relaxed);
+}
+
+void audio_stats_delay(long frames)
+{
+	if (frames >= 0)
+		histogram_add(&audio_stats.delay, frames * 1000000ull / sample_rate);
+}
+
+/** Значения, не превышаемые долями p[] распределения, и наибольшее. */
+static void histogram_print(FILE *out, const char *name, const struct histogram *h)
+{
+	static const double p[] = { 0.5, 0.9, 0.99, 0.999 };
+	unsigned long total = 0;
+	for (unsigned b = 0; b < histogram_bins; ++b)
+		total += h->bin[b];
+	fprintf(out, "%s, мкс:", name);
+	if (!total) {
+		fprintf(out, " нет данных.\n");
+		return;
+	}
+	unsigned long count = 0;
+	unsigned b = 0, i = 0, max = 0;
+	for (; b < histogram_bins; ++b) {
+		const unsigned n = h->bin[b];
+		if (!n)
+			continue;
+		count += n;
+		max = b;
+		for (; i < sizeof(p)/sizeof(*p) && count >= p[i] * total; ++i)
+			fprintf(out, " %g%% %u,", 100 * p[i], histogram_value(b));
+	}
+	fprintf(out, " наибольшее %u (замеров %lu).\n", histogram_value(max), total);
+}
+
+void audio_stats_print(FILE *out)
+{
+	const struct audio_stats *s = &audio_stats;
+	fprintf(out, "Статистика звука: фрагментов %lu (синтез дольше фрагмента %lu), "
+	        "xrun %lu, приостановок %lu, ошибок %lu, восстановление %.3f мс.\n",
+	        s->periods, s->late, s->xruns, s->suspends, s->errors,
+	        s->recover_ns / 1e6);
+	histogram_print(out, "Задержка вывода", &s->delay);
+	histogram_print(out, "Синтез фрагмента", &s->synthesis);
+	fflush(out);
+}
@@ -0,0 +1,61 @@
+/**\file
+ * \brief	Статистика вывода звука: xrun, задержка и время синтеза.
+ *
+ *  Счётчики изменяются потоками вывода без блокировок и выводятся
+ *  audio_stats_print() при завершении или по сигналу SIGUSR1.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+enum {
+	/// Значения до 32 мкс хранятся точно, далее — 16 интервалов на октаву.
+	histogram_exact	= 32,
+	histogram_bins 	= histogram_exact + (32 - 5) * 16,
+};
+
+/** Распределение длительностей в микросекундах (погрешность до 1/16). */
+struct histogram {
+	atomic_uint	bin[histogram_bins];
+};
+
+struct audio_stats {
+	/** Фрагментов синтезировано                           */
+	atomic_ulong    	periods;
+	/** Синтез фрагмента занял больше его длительности     */
+	atomic_ulong    	late;
+	/** Опустошений буфера устройства (-EPIPE)             */
+	atomic_ulong    	xruns;
+	/** Приостановок устройства (-ESTRPIPE)                */
+	atomic_ulong    	suspends;
+	/** Прочих ошибок вывода                               */
+	atomic_ulong    	errors;
+	/** Суммарное время восстановления после ошибок, нс    */
+	atomic_ullong   	recover_ns;
+	/** Задержка вывода (snd_pcm_delay()) после записи, мкс */
+	struct histogram	delay;
+	/** Время синтеза фрагмента, мкс                       */
+	struct histogram	synthesis;
+};
+
+extern struct audio_stats audio_stats;
+
+static inline int64_t audio_stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (int64_t)1000000000 + ts.tv_nsec;
+}
+
+/** Учитывает значение us в распределении. */
+void histogram_add(struct histogram *h, uint32_t us);
+
+/** Задержка вывода в дискретизациях после записи фрагмента. */
+void audio_stats_delay(long frames);
+
+/** Выводит счётчики и процентили распределений. */
+void audio_stats_print(FILE *out);
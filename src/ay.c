@@ -0,0 +1,811 @@
+/**\file*********************************************************************
+ *                                                                     \brief
+ * Эмулятор музыкального процессора AY-3-8912/10.
+ *
+ * Эмулятор, реализованный функциями volmap_init() и ay_make_chunk_ticks(),
+ * заимствован из UnrealSpeсcy by SMT и подпадает под GPL.
+ *
+ ****************************************************************************
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(FH_AY_NO_SIMD) && (defined(__AVX2__) || defined(__SSE2__))
+#include <immintrin.h>
+#endif
+
+#include "ay.h"
+
+enum {
+	// Максимальная громкость учитывает смешивание 3-х каналов с соотв. весами.
+	max_vol	= 0x7fff*100/(100+67+10),
+};
+
+unsigned int	sample_rate	= default_sample_rate;
+
+/**
+ * Отображение возможных громкостей каналов AY на звуковое стереопространство
+ * для 1..ay_max_chips процессоров: громкость каждого снижается пропорционально
+ * их количеству, что бы сумма не выходила за диапазон.
+ */
+static lr32 volmap[ay_max_chips][ay_channels][16];
+
+static void volmap_init(void)
+{
+	// Таблица соответствий 16-ти громкостей AY-3-8912 16-ти разрядному звуку.
+	static const uint16_t	v[16] = {
+		0x0000, 0x0340, 0x04C0, 0x06F2, 0x0A44, 0x0F13, 0x1510, 0x227E,
+		0x289F, 0x414E, 0x5B21, 0x7258, 0x905E, 0xB550, 0xD7A0, 0xFFFF
+	};
+	//  Громкость эмулируемого канала в звуковом стереопространстве.
+	static const uint16_t	stereo[ay_channels][channels] = {
+		//    левый     	    правый     	// каналы
+		{ 100*0x100/100,	010*0x100/100},	// A
+		{ 066*0x100/100,	066*0x100/100},	// B
+		{ 010*0x100/100,	100*0x100/100} 	// C
+	};
+	for (int k = 0; k < ay_max_chips; ++k)
+		for (int j = A; j <= C; ++j)
+			for (int i = 0; i < 16; ++i) {
+				volmap[k][j][i].l = ((v[i] * max_vol >> 16) * stereo[j][L] >> 8) / (k + 1);
+				volmap[k][j][i].r = ((v[i] * max_vol >> 16) * stereo[j][R] >> 8) / (k + 1);
+			}
+}
+
+unsigned	chunk_size;
+
+enum {
+	/// Счётчики генераторов AY изменяются раз в 8 тактов.
+	ay_step    	= 8,
+	/// Шагов счётчиков в одном кадре ZX-Spectrum.
+	frame_steps	= (ay_clock / zx_frame_rate + ay_step - 1) / ay_step,
+};
+
+enum ay_synthesis synthesis = ay_synth_events;
+
+/**
+ * Функции с параметром chips (количество процессоров) встраиваются в
+ * ay_make_samples() для каждого количества процессоров: chips постоянно,
+ * циклы по процессорам разворачиваются или исчезают.
+ */
+#define chips_inline static inline __attribute__((always_inline))
+
+/**
+ * Генераторы процессора, влияющие на выход в текущем кадре (параметр active).
+ * Для одного процессора ay_make_samples() встраивает синтез для каждого
+ * сочетания, выбирая его раз в кадр, так что проверки и загрузки неактивных
+ * генераторов исчезают из внутренних циклов. Для нескольких процессоров
+ * сочетания каждого проверяются по ay.active, что обходится дешевле, чем
+ * продвигать все генераторы. Счётчики неактивных генераторов продвигаются
+ * однократно в конце вызова, что не меняет их состояния.
+ */
+enum {
+	/// Тон канала A (B, C — следующие разряды) не запрещён микшером.
+	active_tone    	= 1,
+	/// Шум не запрещён хотя бы в одном канале.
+	active_noise   	= 1 << ay_channels,
+	/// Громкость хотя бы одного канала задаёт огибающая.
+	active_envelope	= 2 << ay_channels,
+	active_all     	= (4 << ay_channels) - 1,
+};
+
+/** Изменение шумового генератора. */
+static inline void noise_step(struct ay_chip *ay)
+{
+	ay->noise_state = (ay->noise_state * 2 + 1)
+	            ^ (((ay->noise_state >> 16) ^ (ay->noise_state >> 13)) & 1);
+	ay->noise_bit = - ((ay->noise_state >> 16) & 1);
+}
+
+/** Изменение громкости огибающей. */
+static inline void envelope_step(struct ay_chip *ay)
+{
+	ay->envelope_volume += ay->envelope_add;
+	if (ay->envelope_volume & ~0x1F) {
+		unsigned mask = 1 << ay->envelope_mode;
+		if (mask & (0x0F | 1<<9 | 1<<15)) {
+			ay->envelope_volume = ay->envelope_add = 0;
+		} else if (mask & (1<<8 | 1<<12)) {
+			ay->envelope_volume &= 0x1F;
+		} else if (mask & (1<<10 | 1<<14)) {
+			ay->envelope_add = -ay->envelope_add;
+			ay->envelope_volume += ay->envelope_add;
+		} else { // mask 11 | 13
+			ay->envelope_volume = 0x1F;
+			ay->envelope_add = 0;
+		}
+	}
+}
+
+/** Смешивает текущие уровни каналов процессора в стереосэмпл по строке levels таблицы volmap. */
+static inline lr32 chip_quant(const struct ay_chip *ay, const lr32 (*levels)[16])
+{
+	lr32 quant = { 0 };
+	for (int chn = A; chn <= C; ++chn) {
+		unsigned env, bit;
+		env = ay->tone_volume[chn] & 0x10
+		    ? ay->envelope_volume / 2 : ay->tone_volume[chn] & 0x0F;
+		bit = (ay->tone_bit[chn] | ay->tone_mask[chn]) & (ay->noise_bit | ay->noise_mask[chn]);
+		// в SND_PCM_FORMAT_S16 диапазон -/+ volmap
+		quant.l += levels[chn][env].l ^ bit;
+		quant.r += levels[chn][env].r ^ bit;
+	}
+	return quant;
+}
+
+static inline int16_t saturate(int32_t v)
+{
+	return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+}
+
+/** Складывает с насыщением уровни всех процессоров. */
+chips_inline lr32 ay_quant(const struct ay *ay, unsigned chips)
+{
+	const lr32 (*levels)[16] = volmap[chips - 1];
+	if (chips == 1)
+		return chip_quant(&ay->chip[0], levels);
+	int32_t l = 0, r = 0;
+	for (unsigned c = 0; c < chips; ++c) {
+		const lr32 quant = chip_quant(&ay->chip[c], levels);
+		l += quant.l;
+		r += quant.r;
+	}
+	return (lr32){ saturate(l), saturate(r) };
+}
+
+/** Первый шаг кадра, отображаемый в дискретизацию pos или далее. */
+static inline unsigned sample_step(unsigned pos)
+{
+	const uint64_t step = (uint64_t)ay_step * sample_rate;
+	const uint64_t end = (pos * (uint64_t)ay_clock + step - 1) / step;
+	return end < frame_steps ? end : frame_steps;
+}
+
+/**
+ * Формирует дискретизации from..to-1 кадра, изменяя счётчики на каждом шаге
+ * (эталонная реализация).
+ */
+chips_inline void ay_make_samples_ticks(struct ay *ay, lr32 *out, unsigned from, unsigned to,
+                                       unsigned chips)
+{
+	// Последний фрагмент кадра завершает все его шаги.
+	const unsigned end = to < chunk_size ? sample_step(to) : frame_steps;
+	//  Такты AY
+	for (unsigned s = ay->frame_step; s < end; ++s) {
+		const unsigned t = s * ay_step;
+		for (unsigned c = 0; c < chips; ++c) {
+			struct ay_chip *chip = &ay->chip[c];
+			if (++chip->noise_cycle >= chip->noise_frequency) {
+				chip->noise_cycle = 0;
+				noise_step(chip);
+			}
+			if (++chip->envelope_cycle >= chip->envelope_frequency) {
+				chip->envelope_cycle = 0;
+				envelope_step(chip);
+			}
+			for (int chn = A; chn <= C; ++chn) {
+				if (++chip->tone_cycle[chn] >= chip->tone_frequency[chn]) {
+					chip->tone_cycle[chn] = 0;
+					chip->tone_bit[chn] ^= -1;
+				}
+			}
+		}
+		lr32 quant = ay_quant(ay, chips);
+		unsigned pos = t * sample_rate / ay_clock;
+		assert(pos >= from && pos < to);
+		if (pos >= from && pos < to) {
+			out[pos - from] = quant;
+		}
+	}
+	ay->frame_step = end;
+}
+
+/**
+ * Продвигает счётчик генератора на n шагов.
+ * Как и в ay_make_chunk_ticks(), счётчик обнуляется при достижении frequency,
+ * нулевая частота равнозначна единичной.
+ * \return количество переполнений.
+ */
+static inline unsigned counter_advance(unsigned *cycle, unsigned frequency, unsigned n)
+{
+	// Шагов до первого переполнения.
+	unsigned first = *cycle < frequency ? frequency - *cycle : 1;
+	if (n < first) {
+		*cycle += n;
+		return 0;
+	}
+	unsigned period = frequency ? frequency : 1;
+	n -= first;
+	*cycle = n % period;
+	return 1 + n / period;
+}
+
+/**
+ * Выполняет count изменений шумового генератора, как noise_step().
+ * Новый разряд регистра сдвига зависит лишь от разрядов 16 и 13, поэтому
+ * до 14 разрядов вычисляются за раз.
+ */
+static inline void noise_advance(struct ay_chip *ay, unsigned count)
+{
+	if (!count)
+		return;
+	unsigned s = ay->noise_state;
+	for (; count >= 14; count -= 14)
+		s = s << 14 | (~(s >> 3 ^ s) & 0x3FFF);
+	if (count)
+		s = s << count | (~(s >> (17 - count) ^ s >> (14 - count)) & ((1u << count) - 1));
+	ay->noise_state = s;
+	ay->noise_bit = - ((s >> 16) & 1);
+}
+
+/**
+ * Продвигает генераторы процессора из набора active на n шагов, выполняя
+ * лишь переполнения счётчиков.
+ */
+chips_inline void chip_advance(struct ay_chip *ay, unsigned n, unsigned active)
+{
+	if (active & active_noise)
+		noise_advance(ay, counter_advance(&ay->noise_cycle, ay->noise_frequency, n));
+	if (active & active_envelope) {
+		unsigned env = counter_advance(&ay->envelope_cycle, ay->envelope_frequency, n);
+		// Без приращения огибающая неизменна.
+		for (; env && ay->envelope_add; --env)
+			envelope_step(ay);
+	}
+	for (int chn = A; chn <= C; ++chn) {
+		if (active & active_tone << chn
+		 && counter_advance(&ay->tone_cycle[chn], ay->tone_frequency[chn], n) & 1)
+			ay->tone_bit[chn] ^= -1;
+	}
+}
+
+/** Генераторы процессора, влияющие на выход при текущих значениях регистров. */
+static inline unsigned chip_active(const struct ay_chip *ay)
+{
+	unsigned active = 0;
+	for (int chn = A; chn <= C; ++chn) {
+		if (!ay->tone_mask[chn])
+			active |= active_tone << chn;
+		if (!ay->noise_mask[chn])
+			active |= active_noise;
+		if (ay->tone_volume[chn] & 0x10)
+			active |= active_envelope;
+	}
+	return active;
+}
+
+/** Активные генераторы процессора c: для одного процессора набор постоянен. */
+chips_inline unsigned chip_mask(const struct ay *ay, unsigned c, unsigned chips, unsigned active)
+{
+	return chips == 1 ? active : active & ay->active[c];
+}
+
+/** Продвигает активные генераторы всех процессоров на n шагов. */
+chips_inline void ay_advance(struct ay *ay, unsigned n, unsigned chips, unsigned active)
+{
+	for (unsigned c = 0; c < chips; ++c)
+		chip_advance(&ay->chip[c], n, chip_mask(ay, c, chips, active));
+}
+
+/** Продвигает неактивные генераторы на n шагов, выполненных с начала вызова. */
+chips_inline void ay_advance_inactive(struct ay *ay, unsigned n, unsigned chips, unsigned active)
+{
+	for (unsigned c = 0; c < chips && n; ++c) {
+		const unsigned inactive = ~chip_mask(ay, c, chips, active) & active_all;
+		if (inactive)
+			chip_advance(&ay->chip[c], n, inactive);
+	}
+}
+
+/** Запоминает состояние активных генераторов процессора c для i-й дискретизации блока. */
+chips_inline void mix_store(struct ay *ay, unsigned c, unsigned i, unsigned active)
+{
+	const struct ay_chip *chip = &ay->chip[c];
+	for (int chn = A; chn <= C; ++chn) {
+		if (active & active_tone << chn)
+			ay->mix_in.tone[c][chn][i] = chip->tone_bit[chn];
+	}
+	if (active & active_noise)
+		ay->mix_in.noise[c][i]    = chip->noise_bit;
+	if (active & active_envelope)
+		ay->mix_in.envelope[c][i] = chip->envelope_volume;
+}
+
+/**
+ * Продвигает активные генераторы процессора c от шага done к границам
+ * дискретизаций блока ends[0..count-1] и запоминает их состояния для смесителя.
+ */
+chips_inline void chip_store(struct ay *ay, unsigned c, unsigned done, const unsigned *ends,
+                             unsigned count, unsigned active)
+{
+	for (unsigned i = 0; i < count; ++i) {
+		chip_advance(&ay->chip[c], ends[i] - done, active);
+		done = ends[i];
+		mix_store(ay, c, i, active);
+	}
+}
+
+// Перечисление всех 32 сочетаний генераторов: call(active) с постоянным active.
+#define ACTIVE_CASE(call, active) \
+	case active: call(active); break;
+#define ACTIVE_CASES4(call, active) \
+	ACTIVE_CASE(call, active)     ACTIVE_CASE(call, active + 1) \
+	ACTIVE_CASE(call, active + 2) ACTIVE_CASE(call, active + 3)
+#define ACTIVE_CASES16(call, active) \
+	ACTIVE_CASES4(call, active)     ACTIVE_CASES4(call, active + 4) \
+	ACTIVE_CASES4(call, active + 8) ACTIVE_CASES4(call, active + 12)
+#define ACTIVE_CASES32(call) \
+	ACTIVE_CASES16(call, 0) ACTIVE_CASES16(call, 16)
+
+static_assert(active_all == 31, "ACTIVE_CASES32 перечисляют 32 сочетания.");
+
+#define CHIP_STORE(active) chip_store(ay, c, done, ends, count, active)
+
+/**
+ * Выполняет chip_store() для сочетания ay.active[c], выбирая его раз в блок:
+ * каждый из нескольких процессоров продвигается так же, как единственный.
+ */
+static void chip_store_active(struct ay *ay, unsigned c, unsigned done, const unsigned *ends,
+                              unsigned count)
+{
+	switch (ay->active[c]) {
+	ACTIVE_CASES32(CHIP_STORE)
+	}
+}
+
+/**
+ * Смешивает каналы блока дискретизаций, как и ay_quant().
+ * Громкость, маски тона и шума не изменяются в пределах фрагмента,
+ * поэтому уровень канала без огибающей постоянен и выбирается из volmap однократно.
+ * Каналы с огибающей выбираются из volmap по индексу каждой дискретизации.
+ * Для AVX2 сборка выполняется командой vpgatherdd: lr32 занимает 32 разряда,
+ * а маска 0 или -1 инвертирует обе его половины. Для SSE2 элементы lr32
+ * загружаются целиком, по одному на дискретизацию.
+ * Дискретизации занимают элементы векторов, а каналы всех процессоров
+ * накапливаются в них за один проход; процессоры складываются с насыщением.
+ * Неактивные генераторы замаскированы, их состояния не загружаются.
+ */
+chips_inline void ay_mix(const struct ay *ay, lr32 *restrict out, unsigned n, unsigned chips,
+                         unsigned active)
+{
+	unsigned i = 0;
+	const lr32 (*const levels)[16] = volmap[chips - 1];
+	uint32_t envelope[ay_max_chips][ay_channels], fixed[ay_max_chips][ay_channels];
+	unsigned mask[ay_max_chips];
+	for (unsigned c = 0; c < chips; ++c) {
+		mask[c] = chip_mask(ay, c, chips, active);
+		for (int chn = A; chn <= C; ++chn) {
+			envelope[c][chn] = mask[c] & active_envelope && ay->chip[c].tone_volume[chn] & 0x10 ? -1 : 0;
+			fixed[c][chn]    = ay->chip[c].tone_volume[chn] & 0x0F;
+		}
+	}
+#if !defined(FH_AY_NO_SIMD) && defined(__AVX2__)
+	for (; i + 8 <= n; i += 8) {
+		__m256i total = _mm256_setzero_si256();
+		for (unsigned c = 0; c < chips; ++c) {
+			const struct ay_chip *chip = &ay->chip[c];
+			const __m256i noise = mask[c] & active_noise
+			                    ? _mm256_load_si256((const void*)&ay->mix_in.noise[c][i])
+			                    : _mm256_set1_epi32(-1);
+			const __m256i env   = mask[c] & active_envelope
+			                    ? _mm256_srli_epi32(_mm256_load_si256((const void*)&ay->mix_in.envelope[c][i]), 1)
+			                    : _mm256_setzero_si256();
+			__m256i acc = _mm256_setzero_si256();
+			for (int chn = A; chn <= C; ++chn) {
+				__m256i vol;
+				if (envelope[c][chn])
+					vol = _mm256_i32gather_epi32((const int*)levels[chn], env, sizeof(lr32));
+				else
+					vol = _mm256_set1_epi32((uint16_t)levels[chn][fixed[c][chn]].l
+					                      | (uint32_t)(uint16_t)levels[chn][fixed[c][chn]].r << 16);
+				const __m256i tone = mask[c] & active_tone << chn
+				                   ? _mm256_load_si256((const void*)&ay->mix_in.tone[c][chn][i])
+				                   : _mm256_set1_epi32(-1);
+				const __m256i bit  = _mm256_and_si256(
+					_mm256_or_si256(tone,  _mm256_set1_epi32(chip->tone_mask[chn])),
+					_mm256_or_si256(noise, _mm256_set1_epi32(chip->noise_mask[chn])));
+				acc = _mm256_add_epi16(acc, _mm256_xor_si256(vol, bit));
+			}
+			total = _mm256_adds_epi16(total, acc);
+		}
+		_mm256_storeu_si256((void*)&out[i], total);
+	}
+#elif !defined(FH_AY_NO_SIMD) && defined(__SSE2__)
+	for (; i + 4 <= n; i += 4) {
+		__m128i total = _mm_setzero_si128();
+		for (unsigned c = 0; c < chips; ++c) {
+			const struct ay_chip *chip = &ay->chip[c];
+			const __m128i noise = mask[c] & active_noise
+			                    ? _mm_load_si128((const void*)&ay->mix_in.noise[c][i])
+			                    : _mm_set1_epi32(-1);
+			__m128i acc = _mm_setzero_si128();
+			for (int chn = A; chn <= C; ++chn) {
+				__m128i vol;
+				const int *vm = (const int*)levels[chn];
+				if (envelope[c][chn]) {
+					const uint32_t *e = &ay->mix_in.envelope[c][i];
+					vol = _mm_setr_epi32(vm[e[0]/2], vm[e[1]/2], vm[e[2]/2], vm[e[3]/2]);
+				} else {
+					vol = _mm_set1_epi32(vm[fixed[c][chn]]);
+				}
+				const __m128i tone = mask[c] & active_tone << chn
+				                   ? _mm_load_si128((const void*)&ay->mix_in.tone[c][chn][i])
+				                   : _mm_set1_epi32(-1);
+				const __m128i bit  = _mm_and_si128(
+					_mm_or_si128(tone,  _mm_set1_epi32(chip->tone_mask[chn])),
+					_mm_or_si128(noise, _mm_set1_epi32(chip->noise_mask[chn])));
+				acc = _mm_add_epi16(acc, _mm_xor_si128(vol, bit));
+			}
+			total = _mm_adds_epi16(total, acc);
+		}
+		_mm_storeu_si128((void*)&out[i], total);
+	}
+#endif
+	for (; i < n; ++i) {
+		int32_t l = 0, r = 0;
+		for (unsigned c = 0; c < chips; ++c) {
+			const struct ay_chip *chip = &ay->chip[c];
+			lr32 quant = { 0 };
+			for (int chn = A; chn <= C; ++chn) {
+				unsigned env = envelope[c][chn] ? ay->mix_in.envelope[c][i] / 2 : fixed[c][chn];
+				unsigned tone  = mask[c] & active_tone << chn ? ay->mix_in.tone[c][chn][i] : -1;
+				unsigned noise = mask[c] & active_noise ? ay->mix_in.noise[c][i] : -1;
+				unsigned bit = (tone | chip->tone_mask[chn]) & (noise | chip->noise_mask[chn]);
+				quant.l += levels[chn][env].l ^ bit;
+				quant.r += levels[chn][env].r ^ bit;
+			}
+			l += quant.l;
+			r += quant.r;
+		}
+		out[i] = (lr32){ saturate(l), saturate(r) };
+	}
+}
+
+/**
+ * Формирует дискретизации from..to-1 кадра, переходя сразу к последнему
+ * шагу, отображаемому в очередную дискретизацию. Результат совпадает с
+ * ay_make_samples_ticks(): промежуточные состояния генераторов там перезаписываются.
+ */
+chips_inline void ay_make_samples_events(struct ay *ay, lr32 *out, unsigned from, unsigned to,
+                                        unsigned chips, unsigned active)
+{
+	const unsigned start = ay->frame_step;
+	unsigned done = start;
+	for (unsigned pos = from; pos < to && done < frame_steps;) {
+		// Первые шаги, отображаемые в дискретизации после смежного блока first...
+		unsigned ends[mix_block], count = 0, first = pos;
+		for (unsigned last = done; pos < to && count < mix_block; ++pos) {
+			const unsigned end = sample_step(pos + 1);
+			// При высокой частоте дискретизации на позицию может не прийтись ни одного шага.
+			if (end <= last) {
+				if (count)
+					break;
+				first = pos + 1;
+				continue;
+			}
+			// Один процессор продвигается сразу, пока вычисляется следующая граница.
+			if (chips == 1) {
+				chip_advance(&ay->chip[0], end - last, active);
+				mix_store(ay, 0, count, active);
+			}
+			ends[count++] = last = end;
+		}
+		if (!count)
+			break;
+		// Несколько процессоров продвигаются по блоку поочерёдно, смешиваются вместе.
+		for (unsigned c = 0; c < chips && chips > 1; ++c)
+			chip_store_active(ay, c, done, ends, count);
+		ay_mix(ay, &out[first - from], count, chips, active);
+		done = ends[count - 1];
+	}
+	if (to == chunk_size) {
+		assert(done == frame_steps);
+		if (done < frame_steps)
+			ay_advance(ay, frame_steps - done, chips, active);
+		done = frame_steps;
+	}
+	ay_advance_inactive(ay, done - start, chips, active);
+	ay->frame_step = done;
+}
+
+enum {
+	/// Количество отсчётов ступеньки с ограниченным спектром.
+	blep_taps  	= 16,
+	/// Количество сдвигов ступеньки внутри интервала дискретизации.
+	blep_phases	= 64,
+	/// Разрядность дробной части коэффициентов.
+	blep_shift 	= 15,
+};
+
+/**
+ * Приращения ступеньки с ограниченным спектром (производная BLEP)
+ * для каждого из сдвигов перехода относительно сетки дискретизаций.
+ * Сумма коэффициентов каждого сдвига в точности равна 1 << blep_shift,
+ * благодаря чему после затухания ступеньки уровень совпадает с исходным.
+ */
+static int32_t blep_kernel[blep_phases][blep_taps];
+
+/** Вычисляет ядро: окно Блэкмана с импульсной характеристикой фильтра нижних частот. */
+static void blep_init(void)
+{
+	// Частота среза относительно частоты Найквиста.
+	const double cutoff = 0.9;
+	const double pi = 3.14159265358979323846;
+	for (int p = 0; p < blep_phases; ++p) {
+		double h[blep_taps], sum = 0;
+		for (int j = 0; j < blep_taps; ++j) {
+			double x = j - blep_taps/2 + 1 - p / (double)blep_phases;
+			double w = 0.42 + 0.5 * cos(pi * x / (blep_taps/2))
+			         + 0.08 * cos(2 * pi * x / (blep_taps/2));
+			double y = pi * cutoff * x;
+			h[j] = w * cutoff * (x ? sin(y) / y : 1);
+			sum += h[j];
+		}
+		int32_t total = 0, top = 0;
+		for (int j = 0; j < blep_taps; ++j) {
+			blep_kernel[p][j] = lround(h[j] / sum * (1 << blep_shift));
+			total += blep_kernel[p][j];
+			if (blep_kernel[p][j] > blep_kernel[p][top])
+				top = j;
+		}
+		blep_kernel[p][top] += (1 << blep_shift) - total;
+	}
+}
+
+/** Вносит ступеньку, возникшую на шаге step фрагмента. */
+static inline void blep_step(struct ay *ay, unsigned step, lr32 quant)
+{
+	const uint64_t at = (uint64_t)step * ay_step * sample_rate * blep_phases / ay_clock;
+	// Выход задержан на половину ступеньки, так что её начало не выходит за фрагмент.
+	int64_t (*d)[channels] = &ay->blep_delta[at / blep_phases + 1];
+	const int32_t *k = blep_kernel[at % blep_phases];
+	const int dl = quant.l - ay->blep_quant.l;
+	const int dr = quant.r - ay->blep_quant.r;
+	for (int j = 0; j < blep_taps; ++j) {
+		d[j][L] += (int64_t)dl * k[j];
+		d[j][R] += (int64_t)dr * k[j];
+	}
+	ay->blep_quant = quant;
+}
+
+/**
+ * Шагов до ближайшего переполнения счётчика процессора, влияющего на выход.
+ * Прочие счётчики ay_advance() продвигает без остановок.
+ */
+static inline unsigned chip_next_event(const struct ay_chip *ay, unsigned limit)
+{
+	unsigned n = limit;
+	bool noise = false, envelope = false;
+	for (int chn = A; chn <= C; ++chn) {
+		if (!ay->tone_mask[chn]) {
+			unsigned first = ay->tone_cycle[chn] < ay->tone_frequency[chn]
+			               ? ay->tone_frequency[chn] - ay->tone_cycle[chn] : 1;
+			if (n > first)
+				n = first;
+		}
+		noise    |= !ay->noise_mask[chn];
+		envelope |= ay->tone_volume[chn] & 0x10;
+	}
+	if (noise) {
+		unsigned first = ay->noise_cycle < ay->noise_frequency ? ay->noise_frequency - ay->noise_cycle : 1;
+		if (n > first)
+			n = first;
+	}
+	if (envelope && ay->envelope_add) {
+		unsigned first = ay->envelope_cycle < ay->envelope_frequency
+		               ? ay->envelope_frequency - ay->envelope_cycle : 1;
+		if (n > first)
+			n = first;
+	}
+	return n;
+}
+
+/** Вносит ступеньки переходов уровня одного процессора на шагах start..end-1. */
+static inline void blep_steps(struct ay *ay, unsigned start, unsigned end, unsigned active)
+{
+	// Регистры изменены перед кадром — уровень проверяем с первого шага.
+	unsigned done = start;
+	for (unsigned n = done ? chip_next_event(&ay->chip[0], end - done) : 1; done < end;
+	     n = chip_next_event(&ay->chip[0], end - done)) {
+		chip_advance(&ay->chip[0], n, active);
+		done += n;
+		const lr32 quant = ay_quant(ay, 1);
+		if (quant.l != ay->blep_quant.l || quant.r != ay->blep_quant.r)
+			blep_step(ay, done - 1, quant);
+	}
+}
+
+/**
+ * Вносит ступеньки переходов суммарного уровня нескольких процессоров на шагах
+ * start..end-1. Каждый процессор продвигается лишь к своим переполнениям, а его
+ * уровень между ними запоминается, так что переполнения одного процессора не
+ * требуют пересчёта остальных.
+ */
+chips_inline void blep_steps_chips(struct ay *ay, unsigned start, unsigned end, unsigned chips,
+                                   unsigned active)
+{
+	const lr32 (*levels)[16] = volmap[chips - 1];
+	// Шаг, к которому продвинут процессор, и шаг его следующего переполнения.
+	unsigned at[ay_max_chips], next[ay_max_chips];
+	lr32 quant[ay_max_chips];
+	for (unsigned c = 0; c < chips; ++c) {
+		at[c]    = start;
+		next[c]  = start + (start ? chip_next_event(&ay->chip[c], end - start) : 1);
+		quant[c] = chip_quant(&ay->chip[c], levels);
+	}
+	for (unsigned done = start; done < end;) {
+		done = next[0];
+		for (unsigned c = 1; c < chips; ++c)
+			if (next[c] < done)
+				done = next[c];
+		int32_t l = 0, r = 0;
+		for (unsigned c = 0; c < chips; ++c) {
+			struct ay_chip *chip = &ay->chip[c];
+			if (next[c] == done) {
+				chip_advance(chip, done - at[c], chip_mask(ay, c, chips, active));
+				at[c]    = done;
+				next[c]  = done + chip_next_event(chip, end - done);
+				quant[c] = chip_quant(chip, levels);
+			}
+			l += quant[c].l;
+			r += quant[c].r;
+		}
+		const lr32 total = { saturate(l), saturate(r) };
+		if (total.l != ay->blep_quant.l || total.r != ay->blep_quant.r)
+			blep_step(ay, done - 1, total);
+	}
+	for (unsigned c = 0; c < chips; ++c)
+		chip_advance(&ay->chip[c], end - at[c], chip_mask(ay, c, chips, active));
+}
+
+/**
+ * Формирует дискретизации from..to-1 кадра, внося ступеньки с ограниченным
+ * спектром лишь в переходах уровня. В отличие от выборки отсчётов, не порождает
+ * наложения спектров.
+ */
+chips_inline void ay_make_samples_blep(struct ay *ay, lr32 *out, unsigned from, unsigned to,
+                                      unsigned chips, unsigned active)
+{
+	// Ступенька шага вносится в дискретизации после отображаемой им,
+	// поэтому для вывода до to достаточно шагов, отображаемых до to.
+	const unsigned end = to < chunk_size ? sample_step(to) : frame_steps;
+	const unsigned start = ay->frame_step;
+	if (chips == 1)
+		blep_steps(ay, start, end, active);
+	else
+		blep_steps_chips(ay, start, end, chips, active);
+	ay_advance_inactive(ay, end - start, chips, active);
+	ay->frame_step = end;
+	for (unsigned pos = from; pos < to; ++pos) {
+		for (int ch = L; ch <= R; ++ch) {
+			ay->blep_level[ch] += ay->blep_delta[pos][ch];
+			int64_t v = ay->blep_level[ch] >> blep_shift;
+			if (v > INT16_MAX)
+				v = INT16_MAX;
+			if (v < INT16_MIN)
+				v = INT16_MIN;
+			if (ch == L)
+				out[pos - from].l = v;
+			else
+				out[pos - from].r = v;
+		}
+	}
+	if (to < chunk_size)
+		return;
+	memmove(ay->blep_delta, &ay->blep_delta[chunk_size], (blep_taps + 1) * sizeof(*ay->blep_delta));
+	memset(&ay->blep_delta[blep_taps + 1], 0, chunk_size * sizeof(*ay->blep_delta));
+}
+
+chips_inline void ay_make_samples_active(struct ay *ay, lr32 *out, unsigned from, unsigned to,
+                                        unsigned chips, unsigned active)
+{
+	if (synthesis == ay_synth_events)
+		ay_make_samples_events(ay, out, from, to, chips, active);
+	else
+		ay_make_samples_blep(ay, out, from, to, chips, active);
+}
+
+// Вызов ay_make_samples_active() для одного процессора с постоянным набором генераторов.
+#define SAMPLES_ACTIVE(active) ay_make_samples_active(ay, out, from, to, 1, active)
+
+void ay_make_samples(struct ay *ay, lr32 *out, unsigned from, unsigned to)
+{
+	assert(from < to && to <= chunk_size);
+	if (!from)
+		ay->frame_step = 0;
+	if (synthesis == ay_synth_ticks) {
+		// Эталонный синтез не специализируется по генераторам.
+		switch (ay->chips) {
+		case 1: ay_make_samples_ticks(ay, out, from, to, 1); break;
+		case 2: ay_make_samples_ticks(ay, out, from, to, 2); break;
+		case 3: ay_make_samples_ticks(ay, out, from, to, 3); break;
+		case 4: ay_make_samples_ticks(ay, out, from, to, 4); break;
+		}
+	} else if (ay->chips > 1) {
+		// Для нескольких процессоров сочетания проверяются во время синтеза.
+		for (unsigned c = 0; c < ay->chips; ++c)
+			ay->active[c] = chip_active(&ay->chip[c]);
+		switch (ay->chips) {
+		case 2: ay_make_samples_active(ay, out, from, to, 2, active_all); break;
+		case 3: ay_make_samples_active(ay, out, from, to, 3, active_all); break;
+		case 4: ay_make_samples_active(ay, out, from, to, 4, active_all); break;
+		}
+	} else {
+		// Регистры не изменяются внутри кадра, сочетание выбирается для всего вызова.
+		switch (chip_active(&ay->chip[0])) {
+		ACTIVE_CASES32(SAMPLES_ACTIVE)
+		}
+	}
+}
+
+void ay_make_chunk(struct ay *ay, lr32 *out)
+{
+	ay_make_samples(ay, out, 0, chunk_size);
+}
+
+void ay_skip_frame(struct ay *ay)
+{
+	for (unsigned c = 0; c < ay->chips; ++c)
+		chip_advance(&ay->chip[c], frame_steps, active_all);
+	ay->frame_step = frame_steps;
+}
+
+void ay_setup(void)
+{
+	volmap_init();
+	blep_init();
+	chunk_size = sample_rate / zx_frame_rate;
+}
+
+void ay_create(struct ay *ay)
+{
+	*ay = (struct ay) {
+		.chips      = 1,
+		.chip[0]    = { .noise_state = 0xFFFF },
+		.blep_delta = calloc(chunk_size + blep_taps + 1, sizeof(*ay->blep_delta)),
+	};
+}
+
+void ay_set_chips(struct ay *ay, unsigned chips)
+{
+	assert(chips >= 1 && chips <= ay_max_chips);
+	for (unsigned c = ay->chips; c < chips; ++c)
+		ay->chip[c] = (struct ay_chip) { .noise_state = 0xFFFF };
+	ay->chips = chips;
+}
+
+void ay_destroy(struct ay *ay)
+{
+	free(ay->blep_delta);
+}
+
+void ay_write(struct ay *ay, const struct ay_regs *regs)
+{
+	ay_write_chip(ay, 0, regs);
+}
+
+void ay_write_chip(struct ay *ay, unsigned n, const struct ay_regs *regs)
+{
+	struct ay_chip *chip = &ay->chip[n];
+	for (int cn = A; cn <= C; ++cn) {
+		chip->tone_frequency[cn] = regs->tone[cn];
+		chip->tone_volume[cn]    = regs->volume[cn];
+		chip->tone_mask[cn]      = regs->mixer & 1 << cn ? -1 : 0;
+		chip->noise_mask[cn]     = regs->mixer & 8 << cn ? -1 : 0;
+	}
+	// Счётчик шума эмулятора изменяется вдвое чаще.
+	chip->noise_frequency    = regs->noise * 2;
+	chip->envelope_frequency = regs->envelope;
+	if (regs->shape != ay_shape_keep) {
+		chip->envelope_mode   = regs->shape;
+		chip->envelope_cycle  = 0;
+		chip->envelope_volume = 0;
+		chip->envelope_add    = 1;     	// attack
+		if (!(regs->shape & 4)) {
+			chip->envelope_volume += 31;
+			chip->envelope_add = -1;   	// decay
+		}
+	}
+}
@@ -0,0 +1,128 @@
+/**\file
+ * \brief	Эмулятор музыкального процессора AY-3-8912.
+ *
+ *  Синтезирует звук по кадрам ZX-Spectrum (1/50 сек) из значений регистров.
+ *  Кадр может формироваться частями произвольной длины. Несколько процессоров
+ *  (TurboSound) эмулируются одновременно и смешиваются в общий звук.
+ */
+
+#pragma once
+
+#include <stdalign.h>
+#include <stdint.h>
+
+#include "ay_music.h"
+#include "cps.h"
+
+enum {
+	L = 0, R,   	channels,
+
+	zx_frame_rate      	= 50,
+	ay_clock           	= 1773400,
+	default_sample_rate	= 48000,
+};
+
+typedef struct { int16_t l; int16_t r; } lr32;
+
+enum {
+	/// Количество дискретизаций, смешиваемых за раз.
+	mix_block	= 64,
+	/// Наибольшее количество процессоров, звучащих одновременно (TurboSound — 2).
+	ay_max_chips	= 4,
+};
+
+/** Состояние генераторов одного музыкального процессора. */
+struct ay_chip {
+	/** Абстракция регистров музыкального процессора */
+	unsigned	tone_cycle    	[ay_channels];
+	unsigned	tone_frequency	[ay_channels];
+	unsigned	tone_mask     	[ay_channels];
+	unsigned	tone_bit      	[ay_channels];
+	unsigned	tone_volume   	[ay_channels];
+	unsigned	noise_cycle;
+	unsigned	noise_frequency;
+	unsigned	noise_mask    	[ay_channels];
+	unsigned	noise_bit;
+	unsigned	noise_state;
+	unsigned	envelope_cycle;
+	unsigned	envelope_frequency;
+	unsigned	envelope_volume;
+	int     	envelope_add;
+	unsigned	envelope_mode;
+};
+
+/**
+ * Состояние эмулятора: один или несколько музыкальных процессоров,
+ * выходы которых смешиваются в общий стереозвук.
+ */
+struct ay {
+	/** Процессоров, от 1 до ay_max_chips */
+	unsigned      	chips;
+	struct ay_chip	chip[ay_max_chips];
+	/** Генераторы каждого процессора, влияющие на выход, в вызове ay_make_samples() */
+	unsigned      	active[ay_max_chips];
+	/** Шагов счётчиков, выполненных в текущем кадре */
+	unsigned      	frame_step;
+
+	/**
+	 * Состояния генераторов в дискретизациях блока (структура массивов для
+	 * смесителя). Процессоры продвигаются одновременно по общей сетке
+	 * дискретизаций, и смеситель суммирует их за один проход.
+	 */
+	struct {
+		alignas(32) uint32_t	tone[ay_max_chips][ay_channels][mix_block];
+		alignas(32) uint32_t	noise[ay_max_chips][mix_block];
+		alignas(32) uint32_t	envelope[ay_max_chips][mix_block];
+	} mix_in;
+
+	/** Накапливаемые приращения уровня с запасом на «хвосты» ступенек следующего фрагмента. */
+	int64_t	(*blep_delta)[channels];
+	/** Текущий уровень на выходе интегратора (с дробной частью). */
+	int64_t	blep_level[channels];
+	/** Уровень эмулятора в последнем переходе. */
+	lr32   	blep_quant;
+};
+
+/** Частота дискретизации синтезируемого звука. */
+extern unsigned	sample_rate;
+/** Дискретизаций в кадре, вычисляется ay_setup(). */
+extern unsigned	chunk_size;
+/** Способ синтеза для ay_make_chunk(). */
+extern enum ay_synthesis	synthesis;
+
+/** Инициализирует таблицы эмулятора для частоты sample_rate. */
+void ay_setup(void);
+
+/** Создаёт эмулятор одного процессора. */
+void ay_create(struct ay *ay);
+
+/**
+ * Задаёт количество процессоров (TurboSound), выходы которых складываются
+ * с насыщением. Добавленные процессоры начинают с исходного состояния.
+ * Вызывается между кадрами.
+ */
+void ay_set_chips(struct ay *ay, unsigned chips);
+
+void ay_destroy(struct ay *ay);
+
+/** Записывает значения регистров AY. Запись формы перезапускает огибающую. */
+void ay_write(struct ay *ay, const struct ay_regs *regs);
+
+/** Записывает значения регистров процессора n, как ay_write(). */
+void ay_write_chip(struct ay *ay, unsigned n, const struct ay_regs *regs);
+
+/**
+ * Формирует дискретизации from..to-1 текущего кадра (to <= chunk_size).
+ * Части кадра формируются подряд, from == 0 начинает новый кадр.
+ * Результат совпадает с формированием кадра целиком.
+ */
+void ay_make_samples(struct ay *ay, lr32 *out, unsigned from, unsigned to);
+
+/** Формирует фрагмент PCM звука длительностью один кадр (1/50 сек) ZX-Spectrum. */
+void ay_make_chunk(struct ay *ay, lr32 *out);
+
+/**
+ * Продвигает генераторы на кадр без синтеза звука. Состояние процессоров
+ * совпадает с получаемым ay_make_chunk() при любой частоте и способе синтеза.
+ */
+void ay_skip_frame(struct ay *ay);
@@ -1,532 +1,1373 @@
 /**\file*********************************************************************
  *                                                                     \brief
- * Воспроизводит написанные на ZX-Spectrum композиции CPS.
- *
- * Эмулятор музыкального процессора AY-3-8912/10, реализованный функциями
- * ay_init() и ay_make_chunk(), заимствован из UnrealSpeсcy by SMT и
- * подпадает под GPL.
+ * Воспроизводит написанные на ZX-Spectrum композиции CPS эмулятором
+ * музыкального процессора AY-3-8912/10 (ay.c).
  *
  ****************************************************************************
  */
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 
 #include <alloca.h>
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <threads.h>
-#include <alsa/asoundlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
-enum {
-	A = 0, B, C,	ay_channels,
-	L = 0, R,   	channels,
+#include "audio_stats.h"
+#include "ay.h"
+#include "ay_music.h"
+#include "cps.h"
+#include "psg.h"
+#include "sfx.h"
+#include "sink.h"
+#include "zxay.h"
 
-	zx_frame_rate     	= 50,
-	ay_clock          	= 1773400,
+/** Сюда генерируем сэмпл. */
+lr32	*chunk;
 
-	// Максимальная громкость учитывает смешивание 3-х каналов с соотв. весами.
-	max_vol           	= 0x7fff*100/(100+67+10),
+/// Длительность фрагмента, передаваемого приёмнику, мкс.
+static unsigned	period_time = 1000000 / zx_frame_rate;
+unsigned       	period_size;
 
-	default_sample_rate	= 48000,
-	format             	= SND_PCM_FORMAT_S16,
-	chunks             	= 2, ///< Количество фрагментов в буфере звука.
-	default_period_time	= 1000000 / zx_frame_rate,
-	default_buffer_time	= chunks * default_period_time,
-};
+void ay_music_period(unsigned us)
+{
+	period_time = us;
+}
 
-static_assert(channels == 2, "Поддерживается только стереозвук.");
-
-static unsigned int	sample_rate	= default_sample_rate;
-
-/** Абстракция регистров музыкального процессора */
-static unsigned	tone_cycle    	[ay_channels];
-static unsigned	tone_frequency	[ay_channels];
-static unsigned	tone_mask     	[ay_channels];
-static unsigned	tone_bit      	[ay_channels];
-static unsigned	tone_volume   	[ay_channels];
-static unsigned	noise_cycle;
-static unsigned	noise_frequency;
-static unsigned	noise_mask    	[ay_channels];
-static unsigned	noise_bit;
-static unsigned	noise_state;
-static unsigned	envelope_cycle;
-static unsigned	envelope_frequency;
-static unsigned	envelope_volume;
-static int     	envelope_add;
-static unsigned	envelope_mode;
-
-typedef struct { int16_t l; int16_t r; } lr32;
-
-/** Отображение возможных громкостей каналов AY на звуковое стереопространство. */
-static lr32 volmap[ay_channels][16];
-
-static void ay_init(void)
-{
-	// Таблица соответствий 16-ти громкостей AY-3-8912 16-ти разрядному звуку.
-	static const uint16_t	v[16] = {
-		0x0000, 0x0340, 0x04C0, 0x06F2, 0x0A44, 0x0F13, 0x1510, 0x227E,
-		0x289F, 0x414E, 0x5B21, 0x7258, 0x905E, 0xB550, 0xD7A0, 0xFFFF
-	};
-	//  Громкость эмулируемого канала в звуковом стереопространстве.
-	static const uint16_t	stereo[ay_channels][channels] = {
-		//    левый     	    правый     	// каналы
-		{ 100*0x100/100,	010*0x100/100},	// A
-		{ 066*0x100/100,	066*0x100/100},	// B
-		{ 010*0x100/100,	100*0x100/100} 	// C
+void ay_music_synthesis(enum ay_synthesis mode)
+{
+	synthesis = mode;
+}
+
+
+/// Приёмник звука, выбранный ay_music_sink().
+static const struct sink *sink = &alsa_sink;
+static const char        *sink_arg;
+
+bool ay_music_sink(const char *spec)
+{
+	static const struct sink *const sinks[] = {
+		&alsa_sink, &null_sink, &wav_sink, &stdout_sink,
 	};
-	for (int j = A; j <= C; ++j)
-		for (int i = 0; i < 16; ++i) {
-			volmap[j][i].l = ((v[i] * max_vol >> 16) * stereo[j][L] >> 8);
-			volmap[j][i].r = ((v[i] * max_vol >> 16) * stereo[j][R] >> 8);
+	const char *colon = strchr(spec, ':');
+	const size_t len = colon ? colon - spec : strlen(spec);
+	for (int i = 0; i < sizeof(sinks)/sizeof(*sinks); ++i) {
+		if (strlen(sinks[i]->name) == len && !strncmp(spec, sinks[i]->name, len)) {
+			sink = sinks[i];
+			sink_arg = colon ? colon + 1 : NULL;
+			return true;
 		}
-	noise_state = 0xFFFF;
+	}
+	return false;
 }
 
-/** Сюда генерируем сэмпл. */
-lr32    	*chunk;
-unsigned	chunk_size;
-
-/** Формируем фрагмент PCM звука длительностью один кадр (1/50 сек) ZX-Spectrum. */
-static void ay_make_chunk(void)
-{
-	static_assert((int)format == SND_PCM_FORMAT_S16, "Поддерживается только формат SND_PCM_FORMAT_S16.");
-	//  Такты AY
-	for (int t = 0; t < ay_clock / zx_frame_rate; t += 8) {
-		if (++noise_cycle >= noise_frequency) {
-			noise_cycle = 0;
-			noise_state = (noise_state * 2 + 1)
-			            ^ (((noise_state >> 16) ^ (noise_state >> 13)) & 1);
-			noise_bit = - ((noise_state >> 16) & 1);
-		}
-		if (++envelope_cycle >= envelope_frequency) {
-			envelope_cycle = 0;
-			envelope_volume += envelope_add;
-			if (envelope_volume & ~0x1F) {
-				unsigned mask = 1 << envelope_mode;
-				if (mask & (0x0F | 1<<9 | 1<<15)) {
-					envelope_volume = envelope_add = 0;
-				} else if (mask & (1<<8 | 1<<12)) {
-					envelope_volume &= 0x1F;
-				} else if (mask & (1<<10 | 1<<14)) {
-					envelope_add = -envelope_add;
-					envelope_volume += envelope_add;
-				} else { // mask 11 | 13
-					envelope_volume = 0x1F;
-					envelope_add = 0;
-				}
-			}
-		}
-		lr32 quant = { 0 };
-		for (int chn = A; chn <= C; ++chn) {
-			if (++tone_cycle[chn] >= tone_frequency[chn]) {
-				tone_cycle[chn] = 0;
-				tone_bit[chn] ^= -1;
-			}
-			unsigned env, bit;
-			env = tone_volume[chn] & 0x10
-			    ? envelope_volume / 2 : tone_volume[chn] & 0x0F;
-			bit = (tone_bit[chn] | tone_mask[chn]) & (noise_bit | noise_mask[chn]);
-			// в SND_PCM_FORMAT_S16 диапазон -/+ volmap
-			quant.l += volmap[chn][env].l ^ bit;
-			quant.r += volmap[chn][env].r ^ bit;
-		}
-		unsigned pos = t * sample_rate / ay_clock;
-		assert(pos < chunk_size);
-		if (pos < chunk_size) {
-			chunk[pos] = quant;
+bool ay_music_format(const char *name)
+{
+	for (int f = 0; f < sample_formats; ++f) {
+		if (!strcmp(name, sample_format_names[f])) {
+			sample_format = f;
+			sample_format_fixed = true;
+			return true;
 		}
 	}
+	return false;
 }
 
+/**
+ * Предоставляет место для фрагмента длиной period_size: непосредственно
+ * в буфере приёмника, если возможно, иначе в chunk.
+ */
+static lr32 *pcm_chunk_begin(void)
+{
+	lr32 *buff = sink->begin();
+	return buff ? buff : chunk;
+}
 
-static snd_pcm_t *pcm = NULL;
-
-static unsigned int     	period_time	= default_period_time;
-static unsigned int     	buffer_time	= default_buffer_time;
-static snd_pcm_uframes_t	period_size;
-static snd_pcm_uframes_t	buffer_size; ///< Внутренний буфер
-
-// В случае PulseAudio устройство "hw" не выводит звук, а для "default"
-// заявляются все возможные форматы. Что бы избежать передискретизации
-// выбираем формат для "hw" и задаём его для "default".
-static int pcm_init(void)
-{
-	int r, dir = 0;
-	snd_pcm_hw_params_t *hwparams;
-	snd_pcm_hw_params_alloca(&hwparams);
-	static const char *const dev[3] = { "hw", "default", "pulse" };
-	for (int i = 0; i < sizeof(dev)/sizeof(*dev); ++i) {
-		snd_pcm_t *pcm0 = pcm;
-		r = snd_pcm_open(&pcm, dev[i], SND_PCM_STREAM_PLAYBACK, 0);
-		if (r >= 0) {
-			if (i == 1 && pcm0)
-				snd_pcm_close(pcm0);
-			snd_pcm_hw_params_any(pcm, hwparams);
-			snd_pcm_hw_params_set_rate_resample(pcm, hwparams, 0);
-			snd_pcm_hw_params_set_access(pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED);
-			snd_pcm_hw_params_set_format(pcm, hwparams, format);
-			snd_pcm_hw_params_set_channels(pcm, hwparams, channels);
-			snd_pcm_hw_params_set_rate_near(pcm, hwparams, &sample_rate, &dir);
-			snd_pcm_hw_params_set_period_time_near(pcm, hwparams, &period_time, &dir);
-			snd_pcm_hw_params_get_period_size(hwparams, &period_size, &dir);
-			snd_pcm_hw_params_set_buffer_time_near(pcm, hwparams, &buffer_time, &dir);
-			snd_pcm_hw_params_get_buffer_size(hwparams, &buffer_size);
-			r = snd_pcm_hw_params(pcm, hwparams);
-		}
-		if (r >= 0)
-			printf("Звуковое устройство %s: %u канала, %u Гц (буфер %lu дискретизаций, сэмпл %g мс).\n",
-			       dev[i], channels, sample_rate, buffer_size, period_time/1000.0);
-		else
-			printf("Звуковое устройство %s: %s.\n", dev[i], snd_strerror(r));
-		if (i && r >= 0)
-			break;
-	}
-	snd_pcm_sw_params_t *swparams;
-	snd_pcm_sw_params_alloca(&swparams);
-	snd_pcm_sw_params_set_start_threshold(pcm, swparams, period_size);
-	snd_pcm_sw_params_set_avail_min(pcm, swparams, period_size);
-	snd_pcm_sw_params(pcm, swparams);
-	return r;
+/** Передаёт приёмнику фрагмент, размещённый pcm_chunk_begin(). */
+static bool pcm_chunk_commit(lr32 *buff)
+{
+	return buff == chunk ? sink->write(chunk, period_size) : sink->commit(buff);
 }
 
-void pcm_stop(void)
+
+/// Планирование потоков вывода звука (SCHED_OTHER — не изменяется).
+static int 	rt_policy = SCHED_OTHER;
+static int 	rt_priority;
+/// Процессор для потоков вывода звука, -1 — любой.
+static int 	rt_cpu = -1;
+static bool	rt_mlock;
+
+enum {
+	/// Приоритет реального времени по умолчанию, ниже потоков JACK и IRQ.
+	default_rt_priority	= 10,
+};
+
+bool ay_music_realtime(const char *spec)
 {
-	snd_pcm_close(pcm);
+	const char *colon = strchr(spec, ':');
+	const size_t len = colon ? colon - spec : strlen(spec);
+	if (len == 4 && !strncmp(spec, "fifo", len))
+		rt_policy = SCHED_FIFO;
+	else if (len == 2 && !strncmp(spec, "rr", len))
+		rt_policy = SCHED_RR;
+	else
+		return false;
+	rt_priority = colon ? atoi(colon + 1) : default_rt_priority;
+	return true;
 }
 
-bool pcm_play_chunk(lr32 *buff, snd_pcm_uframes_t size)
+void ay_music_cpu(int cpu)
 {
-	while (size > 0) {
-		int r = snd_pcm_writei(pcm, buff, size);
-		if (r >= 0) {
-			buff += r;
-			size -= r;
-			continue;
-		}
-		switch (r) {
-		case -ESTRPIPE:
-			while ((r = snd_pcm_resume(pcm)) == -EAGAIN)
-				sleep(1);
-		case -EPIPE:
-			snd_pcm_prepare(pcm);
-		case -EAGAIN:
-			continue;
-		// TODO переинициализировать?
-		case -ENODEV:
-		case -ENOTTY:
-		case -EBADFD:
-		default:
-			sleep(1);
-			return false;
-		}
+	rt_cpu = cpu;
+}
+
+void ay_music_mlock(bool enable)
+{
+	rt_mlock = enable;
+}
+
+/**
+ * Закрепляет вызывающий поток вывода звука за процессором и повышает его
+ * приоритет, как задано. Что не удалось применить, сообщается, а поток
+ * продолжает работу с прежними параметрами.
+ */
+static void audio_thread_setup(const char *name)
+{
+	if (rt_cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(rt_cpu, &set);
+		const int r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (r)
+			printf("Поток %s не закреплён за процессором %d: %s.\n", name, rt_cpu, strerror(r));
 	}
-	return true;
+	if (rt_policy == SCHED_OTHER)
+		return;
+	const int min = sched_get_priority_min(rt_policy);
+	const int max = sched_get_priority_max(rt_policy);
+	struct sched_param param = {
+		.sched_priority = rt_priority < min ? min : rt_priority > max ? max : rt_priority,
+	};
+	int r = pthread_setschedparam(pthread_self(), rt_policy, &param);
+	// Без CAP_SYS_NICE приоритет ограничен RLIMIT_RTPRIO, пробуем наибольший допустимый.
+	struct rlimit limit;
+	if (r == EPERM && !getrlimit(RLIMIT_RTPRIO, &limit)
+	 && limit.rlim_cur >= min && limit.rlim_cur < param.sched_priority) {
+		param.sched_priority = limit.rlim_cur;
+		r = pthread_setschedparam(pthread_self(), rt_policy, &param);
+	}
+	if (r)
+		printf("Поток %s выполняется с обычным приоритетом: %s.\n", name, strerror(r));
+	else
+		printf("Поток %s: %s, приоритет %d.\n", name,
+		       rt_policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR", param.sched_priority);
+}
+
+/**
+ * Закрепляет в памяти страницы процесса, в том числе уже выделенные буферы
+ * синтеза и вывода, и стеки потоков, что бы вывод не ожидал подкачки.
+ */
+static void memory_lock(void)
+{
+	if (rt_mlock && mlockall(MCL_CURRENT))
+		printf("Память не закреплена (mlockall): %s.\n", strerror(errno));
 }
 
 
 thrd_t player;
+/** Воспроизводить композиции из памяти по мере их готовности. */
+static bool prerender;
+/** Воспроизведение приостановлено, потоки ожидают wake. */
+static atomic_bool paused;
 cnd_t  wake;
 mtx_t  wake_mtx;
-int    ticks;
-bool   pausable;
-bool   exit_player;
+atomic_bool exit_player;
+
+/** Ожидает снятия паузы или завершения. */
+static void pause_wait(void)
+{
+	mtx_lock(&wake_mtx);
+	while (paused && !exit_player)
+		cnd_wait(&wake, &wake_mtx);
+	mtx_unlock(&wake_mtx);
+}
+
+/**
+ * Приостанавливает вывод на время паузы. Вызывается потоком, пишущим
+ * на устройство: недоигранное сбрасывается, что бы звук прервался сразу.
+ */
+static void pcm_pause(void)
+{
+	sink->drop();
+	pause_wait();
+	sink->prepare();
+}
+
+/**
+ * Кольцевой буфер дискретизаций между синтезом (единственный писатель) и
+ * выводом на устройство (единственный читатель). Счётчики записанных и
+ * прочитанных дискретизаций только возрастают и размещены в разных строках
+ * кэша, чтобы потоки не вытесняли их друг у друга.
+ * Ёмкость кратна period_size, поэтому фрагмент не пересекает край буфера.
+ */
+static struct ring {
+	alignas(64) atomic_size_t	head;
+	alignas(64) atomic_size_t	tail;
+	alignas(64) lr32         	*frames;
+	size_t                   	capacity;
+} ring;
+
+thrd_t writer;
+/** Ёмкость кольцевого буфера во фрагментах (0 — синтез выводится сразу). */
+static unsigned ring_depth;
+
+/** Место для очередного фрагмента в кольце, либо NULL, если кольцо заполнено. */
+static lr32 *ring_begin(void)
+{
+	const size_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+	const size_t tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+	if (ring.capacity - (head - tail) < period_size)
+		return NULL;
+	return &ring.frames[head % ring.capacity];
+}
+
+/** Делает фрагмент, заполненный после ring_begin(), доступным для вывода. */
+static void ring_commit(void)
+{
+	atomic_fetch_add_explicit(&ring.head, period_size, memory_order_release);
+}
+
+/**
+ * Выводит на устройство содержимое кольца. Ожидает лишь в snd_pcm_writei(),
+ * либо, если синтез не успевает, небольшую долю периода.
+ */
+int pcm_thread(void *p)
+{
+	audio_thread_setup("вывода звука");
+	while (!exit_player) {
+		if (paused)
+			pcm_pause();
+		const size_t tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+		const size_t head = atomic_load_explicit(&ring.head, memory_order_acquire);
+		if (head == tail) {
+			thrd_sleep(&(struct timespec){ .tv_nsec = period_time * 1000 / 8 }, NULL);
+			continue;
+		}
+		// Выводим до края буфера, остаток — на следующей итерации.
+		const size_t pos = tail % ring.capacity;
+		size_t size = head - tail;
+		if (size > ring.capacity - pos)
+			size = ring.capacity - pos;
+		sink->write(&ring.frames[pos], size);
+		atomic_store_explicit(&ring.tail, tail + size, memory_order_release);
+	}
+	return 0;
+}
+
+/** Ожидает места в кольце для фрагмента. \return NULL при завершении. */
+static lr32 *ring_wait(void)
+{
+	lr32 *buff;
+	while (!(buff = ring_begin()) && !exit_player)
+		thrd_sleep(&(struct timespec){ .tv_nsec = period_time * 1000 / 4 }, NULL);
+	return buff;
+}
+
+/** Место для очередного фрагмента: в кольце, в буфере устройства или chunk. */
+static lr32 *output_begin(void)
+{
+	return ring_depth ? ring_wait() : pcm_chunk_begin();
+}
+
+/** Передаёт дальше фрагмент, размещённый output_begin(). */
+static void output_commit(lr32 *buff)
+{
+	if (ring_depth)
+		ring_commit();
+	else
+		pcm_chunk_commit(buff);
+}
+
+
+/** Инициализирует эмулятор и буферы для частоты sample_rate. */
+static void music_setup(void)
+{
+	ay_setup();
+	period_size = (uint64_t)sample_rate * period_time / 1000000;
+	if (!period_size)
+		period_size = 1;
+	chunk = malloc((period_size > chunk_size ? period_size : chunk_size) * sizeof(*chunk));
+}
+
+static void music_cleanup(void)
+{
+	free(chunk);
+}
+
+/// Получен SIGUSR1: статистику выводит проигрыватель.
+static atomic_bool stats_requested;
+
+static void stats_signal(int sig)
+{
+	stats_requested = true;
+}
+
+static void builtin_setup(void);
 
 int ay_music_init(void)
 {
-	ay_init();
-	int r = pcm_init();
+	sigaction(SIGUSR1, &(struct sigaction) {
+		.sa_handler = stats_signal,
+		.sa_flags   = SA_RESTART,
+	}, NULL);
+	int r = sink->open(sink_arg, period_time);
+	music_setup();
+	builtin_setup();
+	if (!sfx_setup())
+		printf("Звуковые эффекты не синтезированы.\n");
+	mtx_init(&wake_mtx, mtx_plain);
+	cnd_init(&wake);
 	if (r >= 0)
 		printf("Создан эмулятор музыкального процессора AY-3-8912.\n");
-	chunk_size = sample_rate * default_period_time / 1000000;
-	chunk = malloc(chunk_size * channels * sizeof(int16_t));
 	return r;
 }
 
+static void prerender_join(void);
+static void prerender_free(void);
+static void playlist_free(void);
+static void builtin_free(void);
+
+/** Синтез в ay_music_poll() без потока проигрывателя. */
+static bool polled;
+static struct ay polled_ay;
+
 void ay_music_stop(void)
 {
+	ay_music_pause(false);
 	exit_player = true;
-	thrd_join(player, NULL);
-	if (!pausable)
-		mtx_destroy(&wake_mtx);
-	free(chunk);
-	pcm_stop();
+	if (polled)
+		ay_destroy(&polled_ay);
+	else
+		thrd_join(player, NULL);
+	if (prerender)
+		prerender_join();
+	if (ring_depth) {
+		thrd_join(writer, NULL);
+		free(ring.frames);
+	}
+	cnd_destroy(&wake);
+	mtx_destroy(&wake_mtx);
+	audio_stats_print(stdout);
+	prerender_free();
+	playlist_free();
+	builtin_free();
+	sfx_cleanup();
+	music_cleanup();
+	sink->close();
 }
 
-void ay_music_continue(int t)
+void ay_music_pause(bool pause)
 {
-	if (!pausable) {
-		mtx_init(&wake_mtx, mtx_plain);
-		pausable = true;
-	}
-	ticks = t;
-	cnd_signal(&wake);
+	mtx_lock(&wake_mtx);
+	paused = pause;
+	cnd_broadcast(&wake);
+	mtx_unlock(&wake_mtx);
 }
 
 int music_thread(void*);
+static void prerender_start(void);
+
+void ay_music_prerender(bool enable)
+{
+	prerender = enable;
+}
+
+void ay_music_ring(unsigned depth)
+{
+	ring_depth = depth;
+}
 
 void ay_music_play(void)
 {
+	if (ring_depth) {
+		ring.capacity = (ring_depth * chunk_size + period_size - 1) / period_size * period_size;
+		ring.frames = malloc(ring.capacity * sizeof(*ring.frames));
+		if (ring.frames)
+			thrd_create(&writer, pcm_thread, NULL);
+		else
+			ring_depth = 0;
+	}
 	thrd_create(&player, music_thread, NULL);
+	if (prerender)
+		prerender_start();
+	memory_lock();
 }
 
-const uint8_t music_intro[] = {
+// Композиции скомпилированы в значения регистров при сборке (tools/cpsc.c).
+static const struct ay_timeline music_intro =
 #include "../music/foxh.cps.inl"
-};
-static_assert(sizeof(music_intro), "Отсутствуют данные музыки.");
+;
 
-const uint8_t music_game[] = {
+static const struct ay_timeline music_game =
 #include "../music/music16.cps.inl"
+;
+
+/** Композиция: значения регистров для каждого из процессоров. */
+struct music {
+	unsigned                	chips;
+	const struct ay_timeline	*timeline[ay_max_chips];
+	/// Состояния процессоров перед началом шаблонов [patterns][chips], либо NULL.
+	struct ay_chip          	*checkpoint;
+	/// Шаблон, на котором композиция прервана выбором другой (поток интерфейса).
+	unsigned                	resume;
+};
+
+static struct music musics[] = {
+	{ 1, { &music_intro } },
+	{ 1, { &music_game } },
 };
-static_assert(sizeof(music_game), "Отсутствуют данные музыки.");
 
-const uint8_t *musics[] = {
-	music_intro,
-	music_game,
+enum { builtin_musics = sizeof(musics)/sizeof(*musics) };
+
+/** Формат файла композиции, определяемый по расширению имени. */
+struct music_format {
+	const char	*ext;
+	bool      	(*validate)(const uint8_t *data, size_t size);
+	bool      	(*compile)(const uint8_t *data, size_t size, struct ay_timeline *tl);
+	/// Компилируется при загрузке, а не в потоке интерфейса при выборе.
+	bool      	eager;
+};
+
+static const struct music_format formats[] = {
+	{ ".cps", cps_validate,  cps_compile,  false },
+	{ ".psg", psg_validate,  psg_compile,  false },
+	// Проигрыватель Z80 выполняется до нескольких секунд.
+	{ ".ay",  zxay_validate, zxay_compile, true  },
+};
+
+/** Файл композиции, отображённый в память. */
+struct cps_file {
+	const uint8_t            	*data;
+	size_t                   	size;
+	const struct music_format	*format;
+};
+
+/** Композиция из файлов CPS, PSG или AY, по одному на процессор. */
+struct cps_music {
+	struct cps_file   	file[ay_max_chips];
+	unsigned          	files;
+	/// Значения регистров, скомпилированные при выборе.
+	struct ay_timeline	timeline[ay_max_chips];
+	/// music.chips == 0 до компиляции.
+	struct music      	music;
+};
+
+/// Композиции из ay_music_load() следуют в списке за встроенными.
+static struct cps_music	*cps_musics;
+static int             	cps_count;
+
+enum {
+	/// Разрядов номера шаблона в команде проигрывателю.
+	pattern_bits	= 24,
+	/// Разрядов номера композиции.
+	music_bits  	= 24,
 };
 
-static int current_music;
+/**
+ * Команда проигрывателю: композиция и шаблон, с которого её начать.
+ * Порядковый номер в старших разрядах отличает новую команду от выполненной.
+ */
+static atomic_uint_least64_t	music_command;
+/// Звучащие композиция и шаблон в формате команды без порядкового номера.
+static atomic_uint_least64_t	music_playing;
+/// Последняя выбранная композиция и номер команды (поток интерфейса).
+static int                  	selected_music;
+static uint64_t             	command_serial;
 
-void ay_music_select(int num)
+/** Формат файла name, NULL для прочих файлов. */
+static const struct music_format *music_format(const char *name)
 {
-	assert(num < sizeof(musics)/sizeof(*musics));
-	current_music = num;
+	const char *ext = strrchr(name, '.');
+	for (size_t i = 0; ext && i < sizeof(formats)/sizeof(*formats); ++i)
+		if (!strcasecmp(ext, formats[i].ext))
+			return &formats[i];
+	return NULL;
 }
 
-typedef struct uint16_le {
-	uint8_t 	l;
-	uint8_t 	h;
-} uint16_le;
+static int cps_filter(const struct dirent *entry)
+{
+	return music_format(entry->d_name) != NULL;
+}
 
-static inline uint16_t le16(const struct uint16_le *le)
+/**
+ * Номер процессора для части композиции TurboSound «имя+N.cps» (N от 1 до
+ * ay_max_chips), 0 — обычная композиция. В *stem — длина имени до «+».
+ */
+static unsigned cps_part(const char *name, size_t *stem)
 {
-	return le->l + (le->h << 8);
+	const char *ext = strrchr(name, '.');
+	if (ext - name < 3 || ext[-2] != '+' || ext[-1] < '1' || ext[-1] > '0' + ay_max_chips)
+		return 0;
+	*stem = ext - name - 2;
+	return ext[-1] - '0';
 }
 
-/** Заголовок композиции */
-struct compose {
-	// Сигнатура компилятора и сведения об авторстве.
-	char     	signature[0x10];
-	uint8_t  	title_strlen; 	// 0x10
-	char     	title[0x0F];
-	uint8_t  	author_srtlen;	// 0x20
-	char     	author[0x0F];
-	// Данные
-	uint8_t  	loop_position;	// 0x30
-	uint8_t  	positions;    	// 0x31
-	uint8_t  	mode;         	// 0x32 Не используется
-	uint16_le	loop;         	// 0x33
-	uint16_le	pattern_table;	// 0x35
-	uint16_le	sample_table; 	// 0x37
-	uint8_t  	patterns;     	// 0x39 Не используется
-	uint8_t  	element[];    	// 0x3A
-};
+/** Отображает файл в память и проверяет заголовок композиции. */
+static bool cps_map(const char *path, struct cps_file *file)
+{
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	void *data = MAP_FAILED;
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+	const struct music_format *format = music_format(path);
+	if (!format->validate(data, st.st_size)) {
+		munmap(data, st.st_size);
+		return false;
+	}
+	*file = (struct cps_file) {
+		.data   = data,
+		.size   = st.st_size,
+		.format = format,
+	};
+	return true;
+}
+
+static struct music *music_compile(int num);
+
+int ay_music_load(const char *dir)
+{
+	struct dirent **names;
+	const int n = scandir(dir, &names, cps_filter, alphasort);
+	if (n < 0) {
+		fprintf(stderr, "Не открыт каталог %s: %s.\n", dir, strerror(errno));
+		return -1;
+	}
+	struct cps_music *list = realloc(cps_musics, (cps_count + n) * sizeof(*list));
+	if (list)
+		cps_musics = list;
+	int added = 0;
+	// Имя композиции TurboSound, к которой добавляются следующие части.
+	char stem[NAME_MAX + 1] = "";
+	for (int i = 0; i < n; ++i) {
+		const char *name = names[i]->d_name;
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		size_t len = 0;
+		const unsigned part = cps_part(name, &len);
+		struct cps_music *m = list ? &cps_musics[cps_count] : NULL;
+		// Части следуют по порядку сразу за первой частью композиции.
+		const bool next = list && added && part == m[-1].files + 1
+		               && strlen(stem) == len && !strncmp(stem, name, len);
+		if (next)
+			--m;
+		else if (m)
+			*m = (struct cps_music) { 0 };
+		if (m && cps_map(path, &m->file[m->files])) {
+			++m->files;
+			if (!next)
+				++cps_count, ++added;
+			if (part && part == m->files)
+				snprintf(stem, sizeof(stem), "%.*s", (int)len, name);
+			else
+				stem[0] = '\0';
+		} else {
+			fprintf(stderr, "Композиция %s не загружена.\n", path);
+		}
+		free(names[i]);
+	}
+	free(names);
+	for (int i = cps_count - added; i < cps_count; ++i)
+		if (cps_musics[i].file[0].format->eager && !music_compile(builtin_musics + i))
+			fprintf(stderr, "Композиция %d не скомпилирована.\n", builtin_musics + i);
+	printf("Загружено композиций из %s: %d.\n", dir, added);
+	return added;
+}
+
+int ay_music_count(void)
+{
+	return builtin_musics + cps_count;
+}
+
+/** Композиция num, NULL, если она не скомпилирована. */
+static struct music *music_get(int num)
+{
+	if (num < builtin_musics)
+		return &musics[num];
+	struct music *music = &cps_musics[num - builtin_musics].music;
+	return music->chips ? music : NULL;
+}
+
+static void music_checkpoints(struct music *m);
+
+/** Компилирует загруженную композицию при первом выборе или загрузке. */
+static struct music *music_compile(int num)
+{
+	if (num < 0 || num >= ay_music_count())
+		return NULL;
+	struct music *music = music_get(num);
+	if (music)
+		return music;
+	struct cps_music *m = &cps_musics[num - builtin_musics];
+	for (unsigned c = 0; c < m->files; ++c) {
+		const struct cps_file *f = &m->file[c];
+		if (!f->format->compile(f->data, f->size, &m->timeline[c])) {
+			while (c--)
+				cps_timeline_free(&m->timeline[c]);
+			return NULL;
+		}
+		m->music.timeline[c] = &m->timeline[c];
+	}
+	m->music.chips = m->files;
+	music_checkpoints(&m->music);
+	return &m->music;
+}
+
+/** Запоминает шаблон, на котором прерывается звучащая композиция. */
+static void music_leave(void)
+{
+	const uint64_t playing = atomic_load_explicit(&music_playing, memory_order_relaxed);
+	struct music *m = music_get(playing >> pattern_bits);
+	if (m)
+		m->resume = playing & ((1u << pattern_bits) - 1);
+}
+
+/** Передаёт проигрывателю команду начать композицию num с шаблона pattern. */
+static void music_send(int num, unsigned pattern)
+{
+	selected_music = num;
+	// Проигрыватель читает значения регистров и состояния после смены команды.
+	atomic_store_explicit(&music_command, ++command_serial << (pattern_bits + music_bits)
+	                    | (uint64_t)num << pattern_bits | pattern, memory_order_release);
+}
+
+bool ay_music_select(int num)
+{
+	if (!music_compile(num)) {
+		fprintf(stderr, "Композиция %d не скомпилирована.\n", num);
+		return false;
+	}
+	music_leave();
+	music_send(num, 0);
+	return true;
+}
+
+bool ay_music_resume(int num)
+{
+	const struct music *m = music_compile(num);
+	if (!m) {
+		fprintf(stderr, "Композиция %d не скомпилирована.\n", num);
+		return false;
+	}
+	if (num != selected_music) {
+		music_leave();
+		music_send(num, m->resume);
+	}
+	return true;
+}
 
-struct pattern {
-	uint8_t  	length;       	// 0x00
-	uint16_le	envelope_data;	// 0x01..0x02
-	uint16_le	channel[ay_channels];
+bool ay_music_seek(unsigned pattern)
+{
+	const struct music *m = music_get(selected_music);
+	if (!m || !m->checkpoint || pattern >= m->timeline[0]->patterns)
+		return false;
+	music_send(selected_music, pattern);
+	return true;
+}
+
+static void playlist_free(void)
+{
+	for (int i = 0; i < cps_count; ++i) {
+		for (unsigned c = 0; c < cps_musics[i].files; ++c) {
+			cps_timeline_free(&cps_musics[i].timeline[c]);
+			munmap((void*)cps_musics[i].file[c].data, cps_musics[i].file[c].size);
+		}
+		free(cps_musics[i].music.checkpoint);
+	}
+	free(cps_musics);
+	cps_musics = NULL;
+	cps_count = 0;
+}
+
+/** Положение проигрывателя в композиции. */
+struct track {
+	const struct music      	*music;
+	/// Синтезированная заранее композиция, либо NULL.
+	const struct prerendered	*prerendered;
+	/// Номер текущего кадра (при повторе отсчитывается от loop_frame первого процессора).
+	int                     	frame;
+	/// Дискретизаций, выведенных в текущем кадре (chunk_size — кадр завершён).
+	unsigned                	pos;
+	/// Шаблон, которому принадлежит текущий кадр.
+	unsigned                	pattern;
+	/// Последняя выполненная команда music_command.
+	uint64_t                	command;
+	/// Текущий кадр берётся из prerendered, эмулятор лишь продвигается.
+	bool                    	from_pcm;
 };
 
-struct sample {
-	uint8_t  	length;     	// 0x00
-	uint16_le	loop;       	// 0x01..0x02
-	uint8_t  	repeat;     	// 0x03
-	uint8_t  	data[];     	// 0x04
+static void track_init(struct track *t, const struct music *music)
+{
+	*t = (struct track) {
+		.music   = music,
+		.frame   = -1,
+		.pos     = chunk_size,
+		.command = UINT64_MAX,
+	};
+}
+
+/** Кадр timeline, соответствующий кадру frame композиции с повтором с loop_frame. */
+static unsigned timeline_frame(const struct ay_timeline *tl, unsigned frame)
+{
+	if (frame < tl->frames)
+		return frame;
+	const unsigned loop = tl->frames - tl->loop_frame;
+	return loop ? tl->loop_frame + (frame - tl->loop_frame) % loop : tl->frames - 1;
+}
+
+/**
+ * Устанавливает регистры AY на очередной кадр (1/50 сек). Части композиции
+ * TurboSound отсчитывают кадры вместе с первой.
+ * \return true, если композиция началась повторно с loop_frame.
+ */
+static bool track_frame(struct track *t, struct ay *ay)
+{
+	const struct music *m = t->music;
+	const bool looped = ++t->frame >= m->timeline[0]->frames;
+	if (looped)
+		t->frame = m->timeline[0]->loop_frame;
+	if (ay->chips != m->chips)
+		ay_set_chips(ay, m->chips);
+	for (unsigned c = 0; c < m->chips; ++c) {
+		struct ay_regs regs;
+		ay_timeline_regs(m->timeline[c], timeline_frame(m->timeline[c], t->frame), &regs);
+		ay_write_chip(ay, c, &regs);
+	}
+	t->pos = 0;
+	return looped;
+}
+
+/**
+ * Запоминает состояние процессоров перед каждым шаблоном. Генераторы
+ * продвигаются без синтеза звука, поэтому проход по всей композиции занимает
+ * доли процента её воспроизведения. Состояние на границе кадра не зависит от
+ * частоты и способа синтеза, так что переход к шаблону по таблице в точности
+ * продолжает звучание, как если бы композиция играла с начала.
+ */
+static void music_checkpoints(struct music *m)
+{
+	const struct ay_timeline *tl = m->timeline[0];
+	m->checkpoint = malloc(tl->patterns * m->chips * sizeof(*m->checkpoint));
+	if (!m->checkpoint)
+		return;
+	struct track t;
+	struct ay ay;
+	ay_create(&ay);
+	ay_set_chips(&ay, m->chips);
+	track_init(&t, m);
+	for (unsigned p = 0; p < tl->patterns; ++p) {
+		while (t.frame + 1 < (int)tl->pattern_frame[p]) {
+			track_frame(&t, &ay);
+			ay_skip_frame(&ay);
+		}
+		memcpy(&m->checkpoint[p * m->chips], ay.chip, m->chips * sizeof(*ay.chip));
+	}
+	ay_destroy(&ay);
+}
+
+/** Составляет таблицы состояний встроенных композиций. */
+static void builtin_setup(void)
+{
+	for (int i = 0; i < builtin_musics; ++i)
+		music_checkpoints(&musics[i]);
+}
+
+static void builtin_free(void)
+{
+	for (int i = 0; i < builtin_musics; ++i) {
+		free(musics[i].checkpoint);
+		musics[i].checkpoint = NULL;
+		musics[i].resume = 0;
+	}
+}
+
+/**
+ * Переходит к началу шаблона pattern композиции music, восстанавливая
+ * состояние процессоров. Без таблицы состояний композиция начинается сначала.
+ */
+static void track_seek(struct track *t, struct ay *ay, const struct music *music,
+                       unsigned pattern)
+{
+	track_init(t, music);
+	if (!music->checkpoint)
+		return;
+	ay_set_chips(ay, music->chips);
+	memcpy(ay->chip, &music->checkpoint[pattern * music->chips],
+	       music->chips * sizeof(*ay->chip));
+	t->frame   = (int)music->timeline[0]->pattern_frame[pattern] - 1;
+	t->pattern = pattern;
+}
+
+/** Находит шаблон текущего кадра; после повтора с loop_frame — заново. */
+static void track_pattern(struct track *t)
+{
+	const struct ay_timeline *tl = t->music->timeline[0];
+	if (t->pattern < tl->patterns && t->frame < (int)tl->pattern_frame[t->pattern])
+		t->pattern = 0;
+	while (t->pattern + 1 < tl->patterns && t->frame >= (int)tl->pattern_frame[t->pattern + 1])
+		++t->pattern;
+}
+
+/**
+ * Композиция, заранее воспроизведённая в память. Хранятся кадры вступления
+ * до head и повторяемая часть с loop_frame до frames; кадры вступления
+ * от head совпадают с повтором и берутся из него.
+ */
+struct prerendered {
+	lr32       	*pcm;
+	/// Кадров в однократном воспроизведении.
+	unsigned   	frames;
+	/// Кадр, с которого композиция повторяется.
+	unsigned   	loop_frame;
+	/// Кадров вступления, отличающихся от повтора.
+	unsigned   	head;
+	atomic_bool	ready;
 };
 
-struct ornament {
-	uint8_t  	length;     	// 0x00
-	uint8_t  	loop;       	// 0x01
-	uint8_t  	repeat;     	// 0x02
-	uint8_t  	data[];     	// 0x03
+static struct prerendered prerendered[builtin_musics];
+static thrd_t             prerenderers[builtin_musics];
+
+/** Проигрыватель композиции, не связанный с воспроизведением. */
+struct ay_player {
+	struct track	track;
+	struct ay   	ay;
+	/// Повторять композицию с loop_frame, иначе завершить.
+	bool        	loop;
+	bool        	ended;
 };
 
-struct channel {
-	const struct sample  	*sample;
-	const uint8_t        	*sample_data;
-	const struct ornament	*ornament;
-	unsigned     	pattern_elm;
-	uint8_t      	repeat;
-	uint8_t      	note;
-	uint8_t      	so;
-	uint8_t      	quark;   	// 8-ми разрядный счётчик, обнуляется при переполнении.
-	uint8_t      	sample_length;
-	uint8_t      	orn_length;
-	uint8_t      	orn_line;	// 8-ми разрядный счётчик, обнуляется при переполнении.
-	uint8_t      	tone_disp;
+struct ay_player *ay_player_create(int num, bool loop)
+{
+	const struct music *music = music_compile(num);
+	if (!music)
+		return NULL;
+	// Размер структуры кратен её выравниванию, как требует aligned_alloc().
+	struct ay_player *player = aligned_alloc(alignof(struct ay_player), sizeof(*player));
+	if (!player)
+		return NULL;
+	player->loop  = loop;
+	player->ended = false;
+	ay_create(&player->ay);
+	track_init(&player->track, music);
+	return player;
+}
+
+size_t ay_player_length(const struct ay_player *player)
+{
+	return (size_t)player->track.music->timeline[0]->frames * chunk_size;
+}
+
+size_t ay_player_render(struct ay_player *player, void *pcm, size_t size)
+{
+	struct track *t = &player->track;
+	lr32 *out = pcm;
+	size_t done = 0;
+	while (done < size && !player->ended) {
+		if (t->pos == chunk_size && track_frame(t, &player->ay) && !player->loop) {
+			player->ended = true;
+			break;
+		}
+		unsigned n = chunk_size - t->pos;
+		if (n > size - done)
+			n = size - done;
+		ay_make_samples(&player->ay, &out[done], t->pos, t->pos + n);
+		t->pos += n;
+		done += n;
+	}
+	return done;
+}
+
+void ay_player_destroy(struct ay_player *player)
+{
+	if (!player)
+		return;
+	ay_destroy(&player->ay);
+	free(player);
+}
+
+/** Значения регистров всех процессоров в кадрах f1 и f2 композиции m совпадают. */
+static bool frames_equal(const struct music *m, unsigned f1, unsigned f2)
+{
+	for (unsigned c = 0; c < m->chips; ++c) {
+		const struct ay_timeline *tl = m->timeline[c];
+		struct ay_regs r1, r2;
+		ay_timeline_regs(tl, timeline_frame(tl, f1), &r1);
+		ay_timeline_regs(tl, timeline_frame(tl, f2), &r2);
+		if (memcmp(&r1, &r2, sizeof(r1)))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Начало части вступления, совпадающей с повтором. Секвенсор повторяет
+ * композицию, лишь когда его состояние совпадёт с предыдущим, поэтому обычно
+ * вступление — первое исполнение повторяемой части, отличающееся несколькими
+ * кадрами в начале.
+ */
+static unsigned prerender_head(const struct music *m)
+{
+	const struct ay_timeline *tl = m->timeline[0];
+	const unsigned loop = tl->frames - tl->loop_frame;
+	unsigned head = tl->loop_frame;
+	while (head > 0 && head - 1 + loop >= tl->loop_frame
+	    && frames_equal(m, head - 1, head - 1 + loop))
+		--head;
+	return head;
+}
+
+/** Положение кадра frame в prerendered.pcm, кадров. */
+static size_t prerendered_offset(const struct prerendered *pr, unsigned frame)
+{
+	if (frame < pr->head)
+		return frame;
+	if (frame < pr->loop_frame)
+		frame += pr->frames - pr->loop_frame;
+	return pr->head + frame - pr->loop_frame;
+}
+
+/**
+ * Воспроизводит композицию в память с наименьшим приоритетом. Композиции
+ * синтезируются одновременно, каждая своим проигрывателем в своём потоке.
+ * Синтез продолжается с состояния эмулятора на конец композиции, поэтому при
+ * повторе с loop_frame, как и при переходе вступления к кадрам повтора с head,
+ * фаза генераторов может отличаться от живого воспроизведения.
+ */
+static int prerender_thread(void *p)
+{
+	struct prerendered *pr = p;
+	const int num = pr - prerendered;
+	// Поток не должен отнимать время у воспроизведения и отрисовки.
+	struct sched_param param = { .sched_priority = 0 };
+	if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param))
+		printf("Не снижен приоритет предварительного синтеза музыки.\n");
+	const struct ay_timeline *tl = musics[num].timeline[0];
+	pr->frames     = tl->frames;
+	pr->loop_frame = tl->loop_frame;
+	pr->head       = prerender_head(&musics[num]);
+	const unsigned stored = pr->head + pr->frames - pr->loop_frame;
+	struct ay_player *player = ay_player_create(num, false);
+	lr32 *pcm = player ? malloc((size_t)(stored + 1) * chunk_size * sizeof(*pcm)) : NULL;
+	// Кадры вступления, совпадающие с повтором, синтезируются в последний кадр pcm.
+	lr32 *skipped = pcm ? &pcm[(size_t)stored * chunk_size] : NULL;
+	unsigned frame = 0;
+	// Синтезируем по кадру, что бы быстро завершиться по exit_player.
+	for (; pcm && frame < pr->frames && !exit_player; ++frame) {
+		lr32 *out = frame >= pr->head && frame < pr->loop_frame
+		          ? skipped : &pcm[prerendered_offset(pr, frame) * chunk_size];
+		if (ay_player_render(player, out, chunk_size) < chunk_size)
+			break;
+	}
+	ay_player_destroy(player);
+	if (!pcm || frame < pr->frames) {
+		free(pcm);
+		return 0;
+	}
+	pr->pcm = pcm;
+	atomic_store_explicit(&pr->ready, true, memory_order_release);
+	printf("Композиция %d синтезирована в память (%g сек, хранится %g сек).\n",
+	       num, pr->frames / (double)zx_frame_rate, stored / (double)zx_frame_rate);
+	return 0;
+}
+
+static void prerender_start(void)
+{
+	for (int i = 0; i < builtin_musics; ++i)
+		thrd_create(&prerenderers[i], prerender_thread, &prerendered[i]);
+}
+
+static void prerender_join(void)
+{
+	for (int i = 0; i < builtin_musics; ++i)
+		thrd_join(prerenderers[i], NULL);
+}
+
+static void prerender_free(void)
+{
+	for (int i = 0; i < builtin_musics; ++i) {
+		free(prerendered[i].pcm);
+		prerendered[i] = (struct prerendered) { 0 };
+	}
+}
+
+/** Переходит к следующему кадру текущей композиции. */
+static void music_frame(struct track *t, struct ay *ay)
+{
+	// Композиция сменяется на границе кадра.
+	const uint64_t command = atomic_load_explicit(&music_command, memory_order_acquire);
+	const int num = command >> pattern_bits & ((1u << music_bits) - 1);
+	if (t->command != command) {
+		track_seek(t, ay, music_get(num), command & ((1u << pattern_bits) - 1));
+		t->prerendered = num < builtin_musics ? &prerendered[num] : NULL;
+		t->command = command;
+	}
+	track_frame(t, ay);
+	track_pattern(t);
+	atomic_store_explicit(&music_playing, (uint64_t)num << pattern_bits | t->pattern,
+	                      memory_order_relaxed);
+}
+
+static_assert((int)ay_scope_chips == (int)ay_max_chips, "Снимок должен вмещать все процессоры.");
+
+/**
+ * Тройной буфер снимков для отображения. Проигрыватель заполняет scope_back
+ * и обменивает его с промежуточным, отмечая свежим; поток отрисовки забирает
+ * свежий промежуточный в scope_front. Обмен атомарен, так что ни один поток
+ * не ожидает другого, а каждый снимок копируется лишь однажды — при заполнении.
+ */
+static struct ay_scope	scopes[3];
+enum {
+	/// Отметка свежего снимка в scope_middle, младшие разряды — номер буфера.
+	scope_fresh	= 4,
 };
+static atomic_uint    	scope_middle = 1;
+static unsigned       	scope_back   = 2;
+static unsigned       	scope_front  = 0;
+
+/** Публикует громкости каналов и осциллограмму фрагмента buff. */
+static void scope_publish(const struct ay *ay, const lr32 *buff)
+{
+	struct ay_scope *scope = &scopes[scope_back];
+	scope->chips = ay->chips;
+	for (unsigned c = 0; c < ay->chips; ++c) {
+		const struct ay_chip *chip = &ay->chip[c];
+		for (int chn = A; chn <= C; ++chn)
+			scope->level[c][chn] = chip->tone_volume[chn] & 0x10
+			                     ? chip->envelope_volume / 2 : chip->tone_volume[chn] & 0x0F;
+	}
+	for (unsigned i = 0; i < ay_scope_points; ++i) {
+		const lr32 v = buff[(uint64_t)i * period_size / ay_scope_points];
+		scope->wave[i] = (v.l + v.r) / 2;
+	}
+	scope_back = atomic_exchange_explicit(&scope_middle, scope_back | scope_fresh,
+	                                      memory_order_acq_rel) & ~scope_fresh;
+}
+
+const struct ay_scope *ay_music_scope(void)
+{
+	if (atomic_load_explicit(&scope_middle, memory_order_relaxed) & scope_fresh)
+		scope_front = atomic_exchange_explicit(&scope_middle, scope_front,
+		                                       memory_order_acq_rel) & ~scope_fresh;
+	return &scopes[scope_front];
+}
+
+/**
+ * Воспроизводит очередной фрагмент длиной period_size. Регистры изменяются
+ * раз в кадр (1/50 сек), а фрагмент может занимать часть кадра или несколько
+ * кадров, поэтому период вывода не привязан к кадрам. Поверх музыки
+ * смешиваются звуковые эффекты.
+ * \return false, если вывод прерван завершением.
+ */
+static bool music_period(struct track *t, struct ay *ay)
+{
+	lr32 *buff = output_begin();
+	if (!buff)
+		return false;
+	int64_t ns = 0;
+	bool synthesized = false;
+	for (unsigned done = 0; done < period_size;) {
+		const struct prerendered *pr = t->prerendered;
+		if (t->pos == chunk_size) {
+			music_frame(t, ay);
+			pr = t->prerendered;
+			// Источник выбирается на весь кадр. Генераторы продвигаются и без
+			// синтеза, что бы осциллограф показывал громкости огибающей.
+			t->from_pcm = pr && atomic_load_explicit(&pr->ready, memory_order_acquire);
+			if (t->from_pcm)
+				ay_skip_frame(ay);
+		}
+		unsigned n = chunk_size - t->pos;
+		if (n > period_size - done)
+			n = period_size - done;
+		if (t->from_pcm) {
+			memcpy(&buff[done], &pr->pcm[prerendered_offset(pr, t->frame) * chunk_size + t->pos],
+			       n * sizeof(*buff));
+		} else {
+			const int64_t start = audio_stats_now();
+			ay_make_samples(ay, &buff[done], t->pos, t->pos + n);
+			ns += audio_stats_now() - start;
+			synthesized = true;
+		}
+		t->pos += n;
+		done += n;
+	}
+	sfx_mix(buff, period_size);
+	scope_publish(ay, buff);
+	output_commit(buff);
+	if (synthesized)
+		histogram_add(&audio_stats.synthesis, ns / 1000);
+	if (ns > period_time * 1000ll)
+		atomic_fetch_add_explicit(&audio_stats.late, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&audio_stats.periods, 1, memory_order_relaxed);
+	if (atomic_exchange_explicit(&stats_requested, false, memory_order_relaxed))
+		audio_stats_print(stdout);
+	return true;
+}
 
 int music_thread(void *p)
 {
-	static const uint16_t base_frequency[12] = {
-		0xEF8, 0xE10, 0xD60, 0xC80, 0xBD8, 0xB28,
-		0xA88, 0x9F0, 0x960, 0x8E0, 0x858, 0x7E0
-	};
-	unsigned frequency_div[8*12+1], *pfq = frequency_div;
-	for (int octave = 0; octave < 8; ++octave) {
-		for (int semitone = 0; semitone < 12; ++semitone)
-			*pfq++ = base_frequency[semitone] >> octave;
-	}
-	*pfq = 0;
-
-	const uint8_t *data;
-new_music:
-	data = musics[current_music];
-	const struct compose *hdr  = (void*)data;
-	struct channel channel[ay_channels] = {0};
-	unsigned position = 0;
-	unsigned eidx  = 0;
-	unsigned delay = 0;
-
-play_music:
-	if (position >= hdr->positions) {
-		position = hdr->loop_position;
-		eidx = le16(&hdr->loop) - offsetof(struct compose, element);
-	}
-	if (hdr->element[eidx] & 1<<6)
-		delay = hdr->element[eidx++] & 0x3F;
-	assert(delay);
-	const struct pattern *pt = (const void*)&data[le16(&hdr->pattern_table)];
-	const struct pattern *pattern = &pt[hdr->element[eidx] & 0x7F];
-	unsigned env_idx = le16(&pattern->envelope_data);
-	unsigned env_repeat = 1;
-	unsigned env_freq = 0;
-	channel[A].pattern_elm = le16(&pattern->channel[A]);
-	channel[B].pattern_elm = le16(&pattern->channel[B]);
-	channel[C].pattern_elm = le16(&pattern->channel[C]);
-	channel[A].repeat = channel[B].repeat = channel[C].repeat = 1;
-	if (hdr->element[eidx] & 1<<7) {
-		channel[A].tone_disp = hdr->element[++eidx];
-		channel[B].tone_disp = hdr->element[++eidx];
-		channel[C].tone_disp = hdr->element[++eidx];
-	} else {
-		channel[A].tone_disp = 0;
-		channel[B].tone_disp = 0;
-		channel[C].tone_disp = 0;
-	}
-	++eidx;
-	++position;
-	for (unsigned line = 0; line <= pattern->length; ++line) {
-		if (!(--env_repeat)) {
-			if (data[env_idx]) {
-				env_freq = data[env_idx++];
-				env_repeat = 1;
-			} else {
-				env_idx++;
-				env_repeat = data[env_idx++];
-			}
+	audio_thread_setup("синтеза музыки");
+	struct track t;
+	struct ay ay;
+	ay_create(&ay);
+	// Композиция выбирается в начале первого кадра.
+	track_init(&t, NULL);
+	while (!exit_player) {
+		// Приостанавливаем воспроизведение, пока основной поток не возобновит.
+		if (paused) {
+			if (ring_depth)
+				pause_wait();
+			else
+				pcm_pause();
+		}
+		if (!music_period(&t, &ay))
+			break;
+	}
+	ay_destroy(&ay);
+	return 0;
+}
+
+/** Положение в композиции в однопоточном режиме. */
+static struct track polled_track;
+
+void ay_music_play_polled(void)
+{
+	polled = true;
+	ring_depth = 0;
+	ay_create(&polled_ay);
+	track_init(&polled_track, NULL);
+	if (prerender)
+		prerender_start();
+	// Синтез выполняется потоком интерфейса, его приоритет не повышаем.
+	if (rt_policy != SCHED_OTHER || rt_cpu >= 0)
+		printf("В однопоточном режиме приоритет и процессор вывода звука не задаются.\n");
+	memory_lock();
+}
+
+int ay_music_poll_descriptors(struct pollfd *fds, int space)
+{
+	// На время паузы вывод сброшен, а устройство не ожидаем.
+	static bool dropped;
+	if (paused != dropped) {
+		dropped = paused;
+		if (dropped)
+			sink->drop();
+		else
+			sink->prepare();
+	}
+	if (dropped)
+		return 0;
+	return sink->poll_descriptors(fds, space);
+}
+
+bool ay_music_poll(struct pollfd *fds, int count)
+{
+	const int ready = count ? sink->poll_revents(fds, count) : 0;
+	if (ready <= 0)
+		return !ready;
+	// Заполняем всё свободное место, не ожидая устройство.
+	for (;;) {
+		const long avail = sink->avail();
+		if (avail < 0)
+			return false;
+		if (avail < period_size)
+			return true;
+		if (!music_period(&polled_track, &polled_ay))
+			return false;
+	}
+}
+
+/** Время процессора, затраченное потоком. */
+static double cpu_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Воспроизводит композицию num однократно в файл path. Композиция уже
+ * скомпилирована, поэтому функция вызывается из любого потока.
+ * \return 0 при успехе, иначе -1.
+ */
+static int render_file(int num, const char *path)
+{
+	struct ay_player *player = ay_player_create(num, false);
+	lr32 *buff = malloc(chunk_size * sizeof(*buff));
+	if (!player || !buff) {
+		fprintf(stderr, "Отсутствует композиция %d.\n", num);
+		ay_player_destroy(player);
+		free(buff);
+		return -1;
+	}
+	FILE *out = fopen(path, "wb");
+	if (!out) {
+		fprintf(stderr, "Не создан файл %s: %s.\n", path, strerror(errno));
+		ay_player_destroy(player);
+		free(buff);
+		return -1;
+	}
+	// Для файла .wav записываем заголовок, иначе сохраняем данные PCM как есть.
+	const char *ext = strrchr(path, '.');
+	const bool wav = ext && !strcasecmp(ext, ".wav");
+	uint8_t hdr[44];
+	if (wav) {
+		wav_header(hdr, sample_s16, 0);
+		fwrite(hdr, sizeof(hdr), 1, out);
+	}
+	size_t samples = 0, n;
+	const double start = cpu_seconds();
+	// Воспроизводим композицию однократно, до возврата к loop_frame.
+	while ((n = ay_player_render(player, buff, chunk_size))) {
+		fwrite(buff, sizeof(*buff), n, out);
+		samples += n;
+	}
+	const double cpu = cpu_seconds() - start;
+	const uint32_t size = samples * sizeof(*buff);
+	if (wav) {
+		wav_header(hdr, sample_s16, size);
+		fseek(out, 0, SEEK_SET);
+		fwrite(hdr, sizeof(hdr), 1, out);
+	}
+	int r = ferror(out) ? -1 : 0;
+	if (fclose(out) || r) {
+		fprintf(stderr, "Ошибка записи в %s.\n", path);
+		r = -1;
+	}
+	const unsigned long frames = samples / chunk_size;
+	const double seconds = frames / (double)zx_frame_rate;
+	printf("Композиция %d: %lu кадров, %g сек звука %u Гц за %g сек процессора (в %.1f раз быстрее реального времени).\n",
+	       num, frames, seconds, sample_rate, cpu, cpu > 0 ? seconds / cpu : 0.0);
+	ay_player_destroy(player);
+	free(buff);
+	return r;
+}
+
+/**
+ * Сохраняет значения регистров композиции num в файл PSG path, для
+ * TurboSound — по файлу «имя+N.psg» на процессор.
+ * \return 0 при успехе, иначе -1.
+ */
+static int export_psg(const struct music *music, const char *path)
+{
+	const char *ext = strrchr(path, '.');
+	for (unsigned c = 0; c < music->chips; ++c) {
+		char name[PATH_MAX];
+		if (music->chips > 1)
+			snprintf(name, sizeof(name), "%.*s+%u%s", (int)(ext - path), path, c + 1, ext);
+		else
+			snprintf(name, sizeof(name), "%s", path);
+		FILE *out = fopen(name, "wb");
+		if (!out) {
+			fprintf(stderr, "Не создан файл %s: %s.\n", name, strerror(errno));
+			return -1;
 		}
-		// Продолжаем играть предыдущую ноту или генерируем новую.
-		for (int cn = A; cn <= C; ++cn) {
-			if (--channel[cn].repeat)
-				continue;
-			uint8_t elm = data[channel[cn].pattern_elm++];
-			if ((elm & 0x7f) >= 96) {
-				channel[cn].repeat = elm < 0x80 ? elm - 95 : elm - 95 - 96;
-			} else {
-				channel[cn].note   = elm & 0x7F;
-				channel[cn].repeat = 1;
-				channel[cn].quark  = -1;
-				if (elm & 0x80)	{
-					// Sample + Ornament byte
-					uint8_t so = data[channel[cn].pattern_elm++];
-					if (!so)
-						channel[cn].note = 0xFF;
-					if (so & 0x0F)
-						channel[cn].so = (channel[cn].so&0xF0) | (so&0x0F);
-					if (so & 0xF0)
-						channel[cn].so = (channel[cn].so&0x0F) | (so&0xF0);
-				}
-				uint8_t so = channel[cn].so;
-				// Таблица инструментов содержит заглушки для 0-х сэмпла и орнамента.
-				const uint16_le *instrument = (const void*)&data[le16(&hdr->sample_table)];
-				channel[cn].sample = (const void*)&data[le16(&instrument[so >> 4])];
-				channel[cn].sample_length = channel[cn].sample->length;
-				channel[cn].sample_data  = &channel[cn].sample->data[0];
-				channel[cn].ornament = (const void*)&data[le16(&instrument[16 + (so & 0xF)])];
-				channel[cn].orn_length = channel[cn].ornament->length;
-				channel[cn].orn_line   = 0;
-			}
+		const bool written = psg_write(out, music->timeline[c]);
+		if (fclose(out) || !written) {
+			fprintf(stderr, "Ошибка записи в %s.\n", name);
+			return -1;
 		}
-		// Воспроизводим delay квантов.
-		for (unsigned i = 0; i < delay; ++i) {
-			for (int cn = A; cn <= C; ++cn) {
-				tone_mask[cn]  = 0;
-				noise_mask[cn] = -1;
-				if (channel[cn].note >= 0x80) {
-					tone_volume[cn] = 0;
-					tone_mask[cn] = -1;
-				} else {
-					uint8_t note = 0x7F & (channel[cn].note + channel[cn].tone_disp
-					                     + channel[cn].ornament->data[channel[cn].orn_line]);
-					if (note > 96)
-						note = 97;
-					unsigned voltone = channel[cn].sample_data[0]
-					                 + channel[cn].sample_data[1] * 0x100;
-					channel[cn].sample_data += 2;
-					tone_frequency[cn] = 0xFFF & (frequency_div[note] + voltone);
-					if ((voltone & 0xFFF) == 0x7FF) {
-						tone_mask[cn] = -1;
-						tone_frequency[cn] = 0;
-					}
-					if ((voltone & 0xFFF) == 0x800) {
-						tone_frequency[cn] = 0;
-					}
-					uint8_t noise = *channel[cn].sample_data++;
-					if (noise & 1<<6) {
-						unsigned env_mode = voltone >> (8+4);
-						if (env_mode) {
-							envelope_mode = env_mode;
-							envelope_cycle = 0;
-							envelope_volume = 0,
-							envelope_add = 1;     	// attack
-							if (!(env_mode & 4)) {
-								envelope_volume += 31;
-								envelope_add = -1;	// decay
-							}
-						}
-						tone_volume[cn] = 0x10;
-						if (noise & 1<<7) {
-							unsigned envd = *channel[cn].sample_data++;
-							if (env_freq)
-								envelope_frequency = envd + env_freq;
-						} else if (env_freq) {
-							envelope_frequency = env_freq;
-						}
-					} else {
-						tone_volume[cn] = voltone >> (8+4);
-					}
-					if (noise & 1<<5) {
-						noise_frequency = (noise & 0x1F) * 2;
-						noise_mask[cn] = 0;
-					}
-					channel[cn].quark = (channel[cn].quark + 1) & 0xff;
-					if (channel[cn].quark >= channel[cn].sample_length) {
-						channel[cn].quark = 0;
-						channel[cn].sample_length = channel[cn].sample->repeat;
-						channel[cn].sample_data = &data[le16(&channel[cn].sample->loop)];
-					}
-					if (channel[cn].orn_line >= channel[cn].orn_length) {
-						channel[cn].orn_length = channel[cn].ornament->repeat;
-						// Признаком перехода на начало является 0xFF
-						channel[cn].orn_line = channel[cn].ornament->loop;
-					}
-					channel[cn].orn_line = (channel[cn].orn_line + 1) & 0xff;
-				}
-			} // каналы
-			if (exit_player)
-				return 0;
-			if (data != musics[current_music])
-				goto new_music;
-			// Приостанавливаем воспроизведение, пока основной поток не возобновит.
-			if (pausable && --ticks <= 0) {
-				cnd_wait(&wake, &wake_mtx);
-			}
-			ay_make_chunk();
-			pcm_play_chunk(chunk, chunk_size);
-		} // for (i < delay)
-	} // for (line)
-goto play_music;
+		printf("Композиция сохранена в %s: %u кадров.\n", name, music->timeline[c]->frames);
+	}
+	return 0;
 }
 
+int ay_music_render(int num, const char *path)
+{
+	const struct music *music = music_compile(num);
+	if (!music) {
+		fprintf(stderr, "Отсутствует композиция %d.\n", num);
+		return -1;
+	}
+	const char *ext = strrchr(path, '.');
+	if (ext && !strcasecmp(ext, ".psg"))
+		return export_psg(music, path);
+	music_setup();
+	const int r = render_file(num, path);
+	music_cleanup();
+	return r;
+}
+
+/** Задание для потоков ay_music_render_all(). */
+static struct {
+	const char	*dir;
+	/// Следующая композиция, которую возьмёт свободный поток.
+	atomic_int	next;
+	atomic_int	failed;
+} batch;
+
+static int render_worker(void *p)
+{
+	for (int num; (num = atomic_fetch_add(&batch.next, 1)) < ay_music_count();) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%02d.wav", batch.dir, num);
+		if (!music_get(num) || render_file(num, path) < 0)
+			atomic_fetch_add(&batch.failed, 1);
+	}
+	return 0;
+}
+
+int ay_music_render_all(const char *dir)
+{
+	music_setup();
+	// Компиляция изменяет список композиций, поэтому выполняется до запуска потоков.
+	for (int i = 0; i < ay_music_count(); ++i) {
+		if (!music_compile(i))
+			fprintf(stderr, "Композиция %d не скомпилирована.\n", i);
+	}
+	batch.dir = dir;
+	atomic_init(&batch.next, 0);
+	atomic_init(&batch.failed, 0);
+	long workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers > ay_music_count())
+		workers = ay_music_count();
+	if (workers < 1)
+		workers = 1;
+	thrd_t *threads = malloc(workers * sizeof(*threads));
+	long started = 0;
+	while (threads && started < workers
+	    && thrd_create(&threads[started], render_worker, NULL) == thrd_success)
+		++started;
+	// Без потоков синтезируем сами.
+	if (!started)
+		render_worker(NULL);
+	for (long i = 0; i < started; ++i)
+		thrd_join(threads[i], NULL);
+	free(threads);
+	music_cleanup();
+	return batch.failed ? -1 : 0;
+}
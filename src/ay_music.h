@@ -1,11 +1,217 @@
+#pragma once
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Способ синтеза звука эмулятором AY. */
+enum ay_synthesis {
+	/** Потактовая эмуляция: счётчики генераторов изменяются каждые 8 тактов AY. */
+	ay_synth_ticks,
+	/** Переход сразу к переполнениям счётчиков и границам дискретизаций.
+	 *  Результат совпадает с ay_synth_ticks. */
+	ay_synth_events,
+	/** Ступеньки с ограниченным спектром (BLEP) в переходах уровня, без наложения
+	 *  спектров. Выход задержан на 8 дискретизаций. */
+	ay_synth_blep,
+};
+
+enum {
+	/// Точек осциллограммы в снимке ay_scope.
+	ay_scope_points	= 64,
+	/// Процессоров в снимке ay_scope, равно ay_max_chips.
+	ay_scope_chips 	= 4,
+};
+
+/** Снимок звука очередного фрагмента для отображения. */
+struct ay_scope {
+	/** Процессоров в композиции (0 — звук не выводился) */
+	unsigned	chips;
+	/** Громкость каналов A, B, C каждого процессора, 0..15 с учётом огибающей */
+	uint8_t 	level[ay_scope_chips][3];
+	/** Фрагмент (сумма каналов L и R), прореженный до ay_scope_points точек */
+	int16_t 	wave[ay_scope_points];
+};
+
+
+/**
+ * Выбирает приёмник звука до ay_music_init(): "alsa[:устройство]" (по
+ * умолчанию), либо без звуковой карты с темпом по часам: "null", "wav:файл",
+ * "stdout". \return false, если приёмник неизвестен.
+ */
+bool ay_music_sink(const char *spec);
+
+/**
+ * Задаёт формат вывода до ay_music_init(): "s16", "s32" или "float".
+ * По умолчанию выбирается родной формат звуковой карты, что бы звуковой
+ * сервер или модуль plug не преобразовывали его. Синтез ведётся в S16,
+ * другие форматы получаются при копировании в буфер устройства.
+ * \return false, если формат неизвестен.
+ */
+bool ay_music_format(const char *name);
 
 int ay_music_init(void);
 
+/**
+ * Разрешает синтезировать композиции в память фоновым потоком с наименьшим
+ * приоритетом (до вызова ay_music_play()). Пока синтез не завершён,
+ * композиция воспроизводится эмулятором. Требует около 62 МБ при 48 кГц.
+ */
+void ay_music_prerender(bool enable);
+
+/**
+ * Разделяет синтез и вывод звука на 2 потока, связанных кольцевым буфером
+ * ёмкостью depth кадров по 1/50 сек (до вызова ay_music_play()).
+ * Синтез опережает вывод на заполнение буфера, задержки устройства не
+ * останавливают проигрыватель. По умолчанию (0) синтез выводится сразу.
+ */
+void ay_music_ring(unsigned depth);
+
+/**
+ * Задаёт длительность фрагмента, передаваемого устройству, в мкс (до
+ * ay_music_init(), по умолчанию кадр — 20 мс). Буфер устройства вмещает
+ * 2 фрагмента, так что 2–5 мс снижают задержку звука до 4–10 мс.
+ * Регистры AY по-прежнему изменяются 50 раз в секунду.
+ */
+void ay_music_period(unsigned us);
+
+/**
+ * Задаёт потокам синтеза и вывода звука планирование реального времени
+ * (до ay_music_play()): "fifo[:приоритет]" или "rr[:приоритет]". Без
+ * привилегий приоритет снижается до RLIMIT_RTPRIO, а если и это невозможно,
+ * потоки работают с обычным приоритетом, о чём сообщается.
+ * \return false, если политика неизвестна.
+ */
+bool ay_music_realtime(const char *spec);
+
+/** Закрепляет потоки синтеза и вывода звука за процессором cpu (до ay_music_play()). */
+void ay_music_cpu(int cpu);
+
+/**
+ * Закрепляет в памяти (mlockall) страницы процесса, включая буферы звука,
+ * при запуске воспроизведения.
+ */
+void ay_music_mlock(bool enable);
+
 void ay_music_play(void);
 
+/**
+ * Однопоточный режим вместо ay_music_play(): кадры синтезируются в
+ * ay_music_poll(), когда устройство готово принять данные.
+ */
+void ay_music_play_polled(void);
+
+/**
+ * Заполняет не более space дескрипторов для poll() в однопоточном режиме.
+ * \return количество дескрипторов (0 на время паузы).
+ */
+int ay_music_poll_descriptors(struct pollfd *fds, int space);
+
+/**
+ * Обрабатывает результат poll() для дескрипторов ay_music_poll_descriptors():
+ * синтезирует кадры, пока в буфере устройства есть место.
+ * \return false, если продолжать вывод не имеет смысла.
+ */
+bool ay_music_poll(struct pollfd *fds, int count);
+
+/**
+ * Последний снимок звука для отображения. Проигрыватель публикует снимки
+ * без блокировок через тройной буфер, а этот вызов лишь забирает свежий.
+ * Вызывается из одного потока (отрисовки); снимок не изменяется до
+ * следующего вызова.
+ */
+const struct ay_scope *ay_music_scope(void);
+
+/** Завершает воспроизведение и выводит статистику звука (также по SIGUSR1). */
 void ay_music_stop(void);
 
-void ay_music_select(int num);
+/**
+ * Добавляет в список композиции *.cps, записи регистров *.psg и музыку
+ * с проигрывателями Z80 *.ay из каталога dir (до ay_music_play()),
+ * упорядоченные по имени. Файлы отображаются в память, их заголовки
+ * проверяются при загрузке, а значения регистров раскладываются по кадрам
+ * при первом выборе. Файлы AY компилируются сразу при загрузке, чтобы
+ * выбор не выполнял проигрыватель Z80 в потоке интерфейса.
+ * Файлы «имя+1.cps», «имя+2.cps»… (до 4) составляют одну композицию
+ * TurboSound, каждый звучит на своём процессоре AY.
+ * \return количество загруженных композиций или -1, если каталог не открыт.
+ */
+int ay_music_load(const char *dir);
+
+/** Количество композиций: встроенные 0 и 1, затем загруженные. */
+int ay_music_count(void);
+
+/**
+ * Выбирает композицию num для воспроизведения.
+ * \return false, если композиции нет или она не компилируется;
+ *         тогда продолжается предыдущая.
+ */
+bool ay_music_select(int num);
+
+/**
+ * Продолжает композицию num с шаблона, на котором она была прервана выбором
+ * другой, либо начинает её, как ay_music_select(). Звучащая продолжается.
+ */
+bool ay_music_resume(int num);
+
+/**
+ * Переходит к шаблону pattern (по порядку исполнения) выбранной композиции.
+ * Состояние музыкального процессора в начале каждого шаблона сохранено
+ * при компиляции, поэтому переход не требует проигрывать предыдущие.
+ * \return false, если шаблона нет.
+ */
+bool ay_music_seek(unsigned pattern);
+
+/**
+ * Приостанавливает (pause == true) или возобновляет воспроизведение,
+ * например, когда окно скрыто. Темп задают часы звукового устройства.
+ */
+void ay_music_pause(bool pause);
+
+/** Выбирает способ синтеза (по умолчанию ay_synth_events). */
+void ay_music_synthesis(enum ay_synthesis mode);
+
+/**
+ * Воспроизводит композицию num однократно без звукового устройства и
+ * сохраняет PCM в файл (с заголовком WAV, если имя оканчивается на .wav).
+ * Сообщает, во сколько раз синтез быстрее реального времени.
+ * Для имени, оканчивающегося на .psg, сохраняет значения регистров по кадрам
+ * без синтеза (для TurboSound — файлы «имя+N.psg»).
+ * \return 0 при успехе, иначе -1.
+ */
+int ay_music_render(int num, const char *path);
+
+/**
+ * Воспроизводит все композиции в файлы dir/NN.wav параллельно, по потоку
+ * на процессор, как ay_music_render().
+ * \return 0, если записаны все, иначе -1.
+ */
+int ay_music_render_all(const char *dir);
+
+/**
+ * Проигрыватель композиции: эмулятор и положение в ней, независимые от
+ * воспроизведения и друг от друга. Проигрыватели можно использовать
+ * одновременно в разных потоках, например, для синтеза в память или
+ * плавной смены композиций.
+ */
+struct ay_player;
+
+/**
+ * Создаёт проигрыватель композиции num с начала. Вызывается из потока
+ * интерфейса: при первом выборе загруженная композиция компилируется.
+ * \param loop	повторять композицию с кадра повтора, иначе завершить
+ * \return NULL, если композиции нет или не хватает памяти.
+ */
+struct ay_player *ay_player_create(int num, bool loop);
+
+/** Дискретизаций в однократном воспроизведении композиции. */
+size_t ay_player_length(const struct ay_player *player);
+
+/**
+ * Синтезирует не более size стереодискретизаций S16 в pcm с текущего положения.
+ * \return количество синтезированных, меньше size по завершении композиции.
+ */
+size_t ay_player_render(struct ay_player *player, void *pcm, size_t size);
 
-/** После первого вызова придётся вызывать периодически, иначе воспроизведение приостановится. */
-void ay_music_continue(int t);
+void ay_player_destroy(struct ay_player *player);
@@ -0,0 +1,258 @@
+/**\file
+ * \brief	Вывод звука без звуковой карты, темп которого задают часы.
+ *
+ *  Приёмники null (без вывода), wav (файл WAV) и stdout (PCM в стандартный
+ *  вывод) ведут себя как устройство с буфером на 2 фрагмента, воспроизводящее
+ *  дискретизации по часам CLOCK_MONOTONIC. Так игра со звуком запускается
+ *  на машинах без звуковой карты, а затраты эмулятора измеряются отдельно
+ *  от поведения драйвера.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "audio_stats.h"
+#include "sink.h"
+
+enum {
+	/// Ёмкость буфера во фрагментах, как у устройства ALSA.
+	chunks	= 2,
+	ns_per_sec	= 1000000000,
+	/// Дискретизаций, преобразуемых в формат вывода за раз.
+	convert_size	= 1024,
+};
+
+/// Файл для записи дискретизаций, -1 — без вывода.
+static int     	out_fd = -1;
+static bool    	out_wav;
+/// Таймер для poll() в однопоточном режиме.
+static int     	timer_fd = -1;
+/// Момент начала воспроизведения, нс.
+static int64_t 	start;
+/// Дискретизаций передано с начала воспроизведения.
+static uint64_t	written;
+/// Байт данных PCM записано в файл.
+static uint64_t	data_size;
+/// Ёмкость буфера в дискретизациях.
+static size_t  	buffer_size;
+
+static int64_t now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (int64_t)ns_per_sec + ts.tv_nsec;
+}
+
+/** Длительность n дискретизаций, нс. */
+static int64_t duration(uint64_t n)
+{
+	return n / sample_rate * ns_per_sec + n % sample_rate * ns_per_sec / sample_rate;
+}
+
+/**
+ * Дискретизаций в буфере, ожидающих воспроизведения. Если буфер опустел
+ * (вывод не успел), отсчёт времени начинается заново, как после xrun.
+ */
+static uint64_t queued(void)
+{
+	const int64_t t = now(), d = t - start;
+	const uint64_t played = d / ns_per_sec * sample_rate
+	                      + d % ns_per_sec * sample_rate / ns_per_sec;
+	if (played < written)
+		return written - played;
+	if (written)
+		atomic_fetch_add_explicit(&audio_stats.xruns, 1, memory_order_relaxed);
+	start = t;
+	written = 0;
+	return 0;
+}
+
+/** Момент, когда в буфере освободится место для size дискретизаций. */
+static struct timespec ready_time(size_t size)
+{
+	const uint64_t n = written + size;
+	const int64_t t = start + (n > buffer_size ? duration(n - buffer_size) : 0);
+	return (struct timespec) {
+		.tv_sec  = t / ns_per_sec,
+		.tv_nsec = t % ns_per_sec,
+	};
+}
+
+static int clock_open(unsigned period_time)
+{
+	buffer_size = chunks * (sample_rate * (uint64_t)period_time / 1000000);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	start = now();
+	written = 0;
+	data_size = 0;
+	printf("Вывод звука по часам: %u канала, %u Гц, %s (буфер %zu дискретизаций).\n",
+	       channels, sample_rate, sample_format_names[sample_format], buffer_size);
+	return 0;
+}
+
+static int null_open(const char *arg, unsigned period_time)
+{
+	return clock_open(period_time);
+}
+
+static int wav_open(const char *arg, unsigned period_time)
+{
+	if (!arg) {
+		fprintf(stderr, "Не задано имя файла WAV (wav:файл).\n");
+		return -1;
+	}
+	out_fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out_fd < 0) {
+		fprintf(stderr, "Не создан файл %s: %s.\n", arg, strerror(errno));
+		return -1;
+	}
+	uint8_t hdr[44];
+	wav_header(hdr, sample_format, 0);
+	if (write(out_fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
+		close(out_fd);
+		out_fd = -1;
+		return -1;
+	}
+	out_wav = true;
+	return clock_open(period_time);
+}
+
+static int stdout_open(const char *arg, unsigned period_time)
+{
+	// Сообщения printf() перенаправляются в stderr, что бы не смешивать их с PCM.
+	out_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+	if (out_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+		return -1;
+	// Завершение читателя обнаруживается по EPIPE.
+	signal(SIGPIPE, SIG_IGN);
+	return clock_open(period_time);
+}
+
+static void clock_close(void)
+{
+	if (out_wav) {
+		uint8_t hdr[44];
+		wav_header(hdr, sample_format, data_size);
+		errno = 0;
+		if (pwrite(out_fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+			fprintf(stderr, "Не записан заголовок WAV: %s.\n",
+			        errno ? strerror(errno) : "файл не дописан");
+		out_wav = false;
+	}
+	if (out_fd >= 0)
+		close(out_fd);
+	if (timer_fd >= 0)
+		close(timer_fd);
+	out_fd = timer_fd = -1;
+}
+
+static lr32 *clock_begin(void)
+{
+	return NULL;
+}
+
+/** Записывает в файл bytes байт data. */
+static bool write_all(const void *data, size_t bytes)
+{
+	while (bytes) {
+		const ssize_t r = write(out_fd, data, bytes);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		data = (const uint8_t*)data + r;
+		bytes -= r;
+		data_size += r;
+	}
+	return true;
+}
+
+static bool clock_write(const lr32 *buff, size_t size)
+{
+	if (queued() + size > buffer_size) {
+		const struct timespec t = ready_time(size);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR);
+	}
+	if (out_fd >= 0 && sample_format == sample_s16) {
+		if (!write_all(buff, size * sizeof(*buff)))
+			return false;
+	} else if (out_fd >= 0) {
+		static alignas(32) int32_t converted[convert_size][channels];
+		for (size_t done = 0; done < size;) {
+			const size_t n = size - done < convert_size ? size - done : convert_size;
+			sample_convert(converted, &buff[done], n);
+			if (!write_all(converted, n * sample_bytes(sample_format)))
+				return false;
+			done += n;
+		}
+	}
+	written += size;
+	audio_stats_delay(queued());
+	return true;
+}
+
+static void clock_drop(void)
+{
+}
+
+static void clock_prepare(void)
+{
+	start = now();
+	written = 0;
+}
+
+static int clock_poll_descriptors(struct pollfd *fds, int space)
+{
+	if (timer_fd < 0 || space < 1)
+		return 0;
+	queued();
+	const struct itimerspec its = { .it_value = ready_time(period_size) };
+	timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	fds[0] = (struct pollfd) { .fd = timer_fd, .events = POLLIN };
+	return 1;
+}
+
+static int clock_poll_revents(struct pollfd *fds, int count)
+{
+	uint64_t expirations;
+	if (!(fds[0].revents & POLLIN))
+		return 0;
+	if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+		// Срабатывание уже прочитано или вызов прерван: место появится позже.
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		fprintf(stderr, "Ошибка таймера вывода звука: %s.\n", strerror(errno));
+		return -1;
+	}
+	return 1;
+}
+
+static long clock_avail(void)
+{
+	return buffer_size - queued();
+}
+
+#define CLOCK_SINK(sink_name, sink_open) {     \
+	.name             = sink_name,             \
+	.open             = sink_open,             \
+	.close            = clock_close,           \
+	.begin            = clock_begin,           \
+	.write            = clock_write,           \
+	.drop             = clock_drop,            \
+	.prepare          = clock_prepare,         \
+	.poll_descriptors = clock_poll_descriptors,\
+	.poll_revents     = clock_poll_revents,    \
+	.avail            = clock_avail,           \
+}
+
+const struct sink null_sink   = CLOCK_SINK("null",   null_open);
+const struct sink wav_sink    = CLOCK_SINK("wav",    wav_open);
+const struct sink stdout_sink = CLOCK_SINK("stdout", stdout_open);
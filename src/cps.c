@@ -0,0 +1,530 @@
+/**\file
+ * \brief	Секвенсор композиций CPS, написанных на ZX-Spectrum.
+ *
+ *  Компилирует композицию в значения регистров AY по кадрам. Используется
+ *  как при сборке (tools/cpsc.c), так и проигрывателем.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cps.h"
+
+typedef struct uint16_le {
+	uint8_t 	l;
+	uint8_t 	h;
+} uint16_le;
+
+static inline uint16_t le16(const struct uint16_le *le)
+{
+	return le->l + (le->h << 8);
+}
+
+/** Заголовок композиции */
+struct compose {
+	// Сигнатура компилятора и сведения об авторстве.
+	char     	signature[0x10];
+	uint8_t  	title_strlen; 	// 0x10
+	char     	title[0x0F];
+	uint8_t  	author_srtlen;	// 0x20
+	char     	author[0x0F];
+	// Данные
+	uint8_t  	loop_position;	// 0x30
+	uint8_t  	positions;    	// 0x31
+	uint8_t  	mode;         	// 0x32 Не используется
+	uint16_le	loop;         	// 0x33
+	uint16_le	pattern_table;	// 0x35
+	uint16_le	sample_table; 	// 0x37
+	uint8_t  	patterns;     	// 0x39 Не используется
+	uint8_t  	element[];    	// 0x3A
+};
+
+struct pattern {
+	uint8_t  	length;       	// 0x00
+	uint16_le	envelope_data;	// 0x01..0x02
+	uint16_le	channel[ay_channels];
+};
+
+struct sample {
+	uint8_t  	length;     	// 0x00
+	uint16_le	loop;       	// 0x01..0x02
+	uint8_t  	repeat;     	// 0x03
+	uint8_t  	data[];     	// 0x04
+};
+
+struct ornament {
+	uint8_t  	length;     	// 0x00
+	uint8_t  	loop;       	// 0x01
+	uint8_t  	repeat;     	// 0x02
+	uint8_t  	data[];     	// 0x03
+};
+
+struct channel {
+	const struct sample  	*sample;
+	const uint8_t        	*sample_data;
+	const struct ornament	*ornament;
+	unsigned     	pattern_elm;
+	uint8_t      	repeat;
+	uint8_t      	note;
+	uint8_t      	so;
+	uint8_t      	quark;   	// 8-ми разрядный счётчик, обнуляется при переполнении.
+	uint8_t      	sample_length;
+	uint8_t      	orn_length;
+	uint8_t      	orn_line;	// 8-ми разрядный счётчик, обнуляется при переполнении.
+	uint8_t      	tone_disp;
+};
+
+/** Лежат ли count байт по смещению offset в пределах size. */
+static inline bool in_range(size_t offset, size_t count, size_t size)
+{
+	return offset <= size && count <= size - offset;
+}
+
+/** Делитель частоты AY для ноты из 8-ми октав, либо 0 для паузы. */
+static unsigned note_divider(uint8_t note)
+{
+	static const uint16_t base_frequency[12] = {
+		0xEF8, 0xE10, 0xD60, 0xC80, 0xBD8, 0xB28,
+		0xA88, 0x9F0, 0x960, 0x8E0, 0x858, 0x7E0
+	};
+	return note < 8*12 ? base_frequency[note % 12] >> note / 12 : 0;
+}
+
+/** Состояние проигрывателя композиции между кадрами. */
+struct sequencer {
+	const uint8_t        	*data;
+	/// Конец данных композиции.
+	const uint8_t        	*end;
+	const struct compose 	*hdr;
+	/// Текущий шаблон, NULL до начала воспроизведения.
+	const struct pattern 	*pattern;
+	struct channel       	channel[ay_channels];
+	unsigned             	position;
+	unsigned             	eidx;
+	/// Длительность строки шаблона в кадрах.
+	unsigned             	delay;
+	/// Кадр в строке шаблона.
+	unsigned             	quantum;
+	/// Следующая строка шаблона.
+	unsigned             	line;
+	unsigned             	env_idx;
+	unsigned             	env_repeat;
+	unsigned             	env_freq;
+	/// Номер текущего кадра от начала композиции (при повторе отсчитывается от loop_frame).
+	int                  	frame;
+	/// Номер кадра, с которого начинается позиция loop_position.
+	int                  	loop_frame;
+	/// Композиция потребовала данные за её пределами.
+	bool                 	overrun;
+};
+
+static void sequencer_init(struct sequencer *sq, const uint8_t *data, size_t size)
+{
+	*sq = (struct sequencer) {
+		.data       = data,
+		.end        = data + size,
+		.hdr        = (const void*)data,
+		.frame      = -1,
+		.loop_frame = -1,
+	};
+}
+
+/** Байт шаблона или сэмпла, за пределами композиции — 0. */
+static inline uint8_t sequencer_byte(struct sequencer *sq, const uint8_t *p)
+{
+	if (p < sq->end)
+		return *p;
+	sq->overrun = true;
+	return 0;
+}
+
+/**
+ * Переходит к следующему шаблону.
+ * \return true, если композиция началась повторно с позиции loop_position.
+ */
+static bool sequencer_pattern(struct sequencer *sq)
+{
+	const struct compose *hdr = sq->hdr;
+	const uint8_t *data = sq->data;
+	struct channel *channel = sq->channel;
+	bool looped = false;
+	if (sq->position >= hdr->positions) {
+		sq->position = hdr->loop_position;
+		sq->eidx = le16(&hdr->loop) - offsetof(struct compose, element);
+		looped = true;
+	}
+	if (hdr->element[sq->eidx] & 1<<6)
+		sq->delay = hdr->element[sq->eidx++] & 0x3F;
+	assert(sq->delay);
+	const struct pattern *pt = (const void*)&data[le16(&hdr->pattern_table)];
+	const struct pattern *pattern = &pt[hdr->element[sq->eidx] & 0x7F];
+	sq->pattern = pattern;
+	sq->line = 0;
+	sq->env_idx = le16(&pattern->envelope_data);
+	sq->env_repeat = 1;
+	sq->env_freq = 0;
+	channel[A].pattern_elm = le16(&pattern->channel[A]);
+	channel[B].pattern_elm = le16(&pattern->channel[B]);
+	channel[C].pattern_elm = le16(&pattern->channel[C]);
+	channel[A].repeat = channel[B].repeat = channel[C].repeat = 1;
+	if (hdr->element[sq->eidx] & 1<<7) {
+		channel[A].tone_disp = hdr->element[++sq->eidx];
+		channel[B].tone_disp = hdr->element[++sq->eidx];
+		channel[C].tone_disp = hdr->element[++sq->eidx];
+	} else {
+		channel[A].tone_disp = 0;
+		channel[B].tone_disp = 0;
+		channel[C].tone_disp = 0;
+	}
+	++sq->eidx;
+	++sq->position;
+	return looped;
+}
+
+/** Обрабатывает очередную строку шаблона: огибающую и ноты каналов. */
+static void sequencer_line(struct sequencer *sq)
+{
+	const uint8_t *data = sq->data;
+	struct channel *channel = sq->channel;
+	if (!(--sq->env_repeat)) {
+		if (sequencer_byte(sq, &data[sq->env_idx])) {
+			sq->env_freq = sequencer_byte(sq, &data[sq->env_idx++]);
+			sq->env_repeat = 1;
+		} else {
+			sq->env_idx++;
+			sq->env_repeat = sequencer_byte(sq, &data[sq->env_idx++]);
+		}
+	}
+	// Продолжаем играть предыдущую ноту или генерируем новую.
+	for (int cn = A; cn <= C; ++cn) {
+		if (--channel[cn].repeat)
+			continue;
+		uint8_t elm = sequencer_byte(sq, &data[channel[cn].pattern_elm++]);
+		if ((elm & 0x7f) >= 96) {
+			channel[cn].repeat = elm < 0x80 ? elm - 95 : elm - 95 - 96;
+		} else {
+			channel[cn].note   = elm & 0x7F;
+			channel[cn].repeat = 1;
+			channel[cn].quark  = -1;
+			if (elm & 0x80)	{
+				// Sample + Ornament byte
+				uint8_t so = sequencer_byte(sq, &data[channel[cn].pattern_elm++]);
+				if (!so)
+					channel[cn].note = 0xFF;
+				if (so & 0x0F)
+					channel[cn].so = (channel[cn].so&0xF0) | (so&0x0F);
+				if (so & 0xF0)
+					channel[cn].so = (channel[cn].so&0x0F) | (so&0xF0);
+			}
+			uint8_t so = channel[cn].so;
+			// Таблица инструментов содержит заглушки для 0-х сэмпла и орнамента.
+			// Смещения неиспользуемых инструментов могут быть произвольными,
+			// поэтому проверяются лишь при выборе.
+			const uint16_le *instrument = (const void*)&data[le16(&sq->hdr->sample_table)];
+			const size_t size = sq->end - data;
+			const size_t sample = le16(&instrument[so >> 4]);
+			const size_t ornament = le16(&instrument[16 + (so & 0xF)]);
+			if (!in_range(sample, sizeof(struct sample), size)
+			 || !in_range(ornament, sizeof(struct ornament), size)) {
+				sq->overrun = true;
+				channel[cn].note = 0xFF;
+				continue;
+			}
+			channel[cn].sample = (const void*)&data[sample];
+			channel[cn].sample_length = channel[cn].sample->length;
+			channel[cn].sample_data  = &channel[cn].sample->data[0];
+			channel[cn].ornament = (const void*)&data[ornament];
+			channel[cn].orn_length = channel[cn].ornament->length;
+			channel[cn].orn_line   = 0;
+		}
+	}
+	++sq->line;
+}
+
+/** Устанавливает регистры AY для одного кадра (кванта) строки шаблона. */
+static void sequencer_quantum(struct sequencer *sq, struct ay_regs *regs)
+{
+	const uint8_t *data = sq->data;
+	struct channel *channel = sq->channel;
+	// Шум во всех каналах запрещён, пока сэмпл не разрешит.
+	regs->mixer = 070;
+	regs->shape = ay_shape_keep;
+	for (int cn = A; cn <= C; ++cn) {
+		if (channel[cn].note >= 0x80) {
+			regs->volume[cn] = 0;
+			regs->mixer |= 1 << cn;
+		} else {
+			uint8_t note = 0x7F & (channel[cn].note + channel[cn].tone_disp
+			                     + sequencer_byte(sq, &channel[cn].ornament->data[channel[cn].orn_line]));
+			if (note > 96)
+				note = 97;
+			unsigned voltone = sequencer_byte(sq, &channel[cn].sample_data[0])
+			                 + sequencer_byte(sq, &channel[cn].sample_data[1]) * 0x100;
+			channel[cn].sample_data += 2;
+			regs->tone[cn] = 0xFFF & (note_divider(note) + voltone);
+			if ((voltone & 0xFFF) == 0x7FF) {
+				regs->mixer |= 1 << cn;
+				regs->tone[cn] = 0;
+			}
+			if ((voltone & 0xFFF) == 0x800) {
+				regs->tone[cn] = 0;
+			}
+			uint8_t noise = sequencer_byte(sq, channel[cn].sample_data++);
+			if (noise & 1<<6) {
+				unsigned env_mode = voltone >> (8+4);
+				if (env_mode)
+					regs->shape = env_mode;
+				regs->volume[cn] = 0x10;
+				if (noise & 1<<7) {
+					unsigned envd = sequencer_byte(sq, channel[cn].sample_data++);
+					if (sq->env_freq)
+						regs->envelope = envd + sq->env_freq;
+				} else if (sq->env_freq) {
+					regs->envelope = sq->env_freq;
+				}
+			} else {
+				regs->volume[cn] = voltone >> (8+4);
+			}
+			if (noise & 1<<5) {
+				regs->noise = noise & 0x1F;
+				regs->mixer &= ~(8 << cn);
+			}
+			channel[cn].quark = (channel[cn].quark + 1) & 0xff;
+			if (channel[cn].quark >= channel[cn].sample_length) {
+				channel[cn].quark = 0;
+				channel[cn].sample_length = channel[cn].sample->repeat;
+				channel[cn].sample_data = &data[le16(&channel[cn].sample->loop)];
+			}
+			if (channel[cn].orn_line >= channel[cn].orn_length) {
+				channel[cn].orn_length = channel[cn].ornament->repeat;
+				// Признаком перехода на начало является 0xFF
+				channel[cn].orn_line = channel[cn].ornament->loop;
+			}
+			channel[cn].orn_line = (channel[cn].orn_line + 1) & 0xff;
+		}
+	} // каналы
+}
+
+/**
+ * Устанавливает регистры AY на очередной кадр (1/50 сек).
+ * \return true, если композиция началась повторно с позиции loop_position.
+ */
+static bool sequencer_frame(struct sequencer *sq, struct ay_regs *regs)
+{
+	bool looped = false;
+	++sq->frame;
+	if (!sq->pattern || sq->quantum >= sq->delay) {
+		if (!sq->pattern || sq->line > sq->pattern->length) {
+			looped = sequencer_pattern(sq);
+			if (looped)
+				sq->frame = sq->loop_frame;
+			else if (sq->position - 1 == sq->hdr->loop_position)
+				sq->loop_frame = sq->frame;
+		}
+		sequencer_line(sq);
+		sq->quantum = 0;
+	}
+	sequencer_quantum(sq, regs);
+	++sq->quantum;
+	return looped;
+}
+
+/** Совпадают ли состояния секвенсоров (без учёта номеров кадров). */
+static bool sequencer_equal(const struct sequencer *s1, const struct sequencer *s2)
+{
+	for (int cn = A; cn <= C; ++cn) {
+		const struct channel *c1 = &s1->channel[cn], *c2 = &s2->channel[cn];
+		if (c1->sample != c2->sample || c1->sample_data != c2->sample_data
+		 || c1->ornament != c2->ornament || c1->pattern_elm != c2->pattern_elm
+		 || c1->repeat != c2->repeat || c1->note != c2->note || c1->so != c2->so
+		 || c1->quark != c2->quark || c1->sample_length != c2->sample_length
+		 || c1->orn_length != c2->orn_length || c1->orn_line != c2->orn_line
+		 || c1->tone_disp != c2->tone_disp)
+			return false;
+	}
+	return s1->pattern == s2->pattern && s1->position == s2->position
+	    && s1->eidx == s2->eidx && s1->delay == s2->delay
+	    && s1->quantum == s2->quantum && s1->line == s2->line
+	    && s1->env_idx == s2->env_idx && s1->env_repeat == s2->env_repeat
+	    && s1->env_freq == s2->env_freq;
+}
+
+/** Совпадают ли значения регистров в кадрах. */
+static bool regs_equal(const struct ay_regs *r1, const struct ay_regs *r2)
+{
+	for (int cn = A; cn <= C; ++cn) {
+		if (r1->tone[cn] != r2->tone[cn] || r1->volume[cn] != r2->volume[cn])
+			return false;
+	}
+	return r1->noise == r2->noise && r1->mixer == r2->mixer
+	    && r1->envelope == r2->envelope && r1->shape == r2->shape;
+}
+
+bool cps_validate(const uint8_t *data, size_t size)
+{
+	const struct compose *hdr = (const void*)data;
+	if (!in_range(0, sizeof(*hdr), size) || !hdr->positions
+	 || hdr->loop_position >= hdr->positions)
+		return false;
+
+	// Таблица инструментов: 16 сэмплов, затем 16 орнаментов.
+	if (!in_range(le16(&hdr->sample_table), 32 * sizeof(uint16_le), size))
+		return false;
+
+	// Позиции: длительность строки, шаблон и смещения нот каналов.
+	const size_t pattern_table = le16(&hdr->pattern_table);
+	size_t eidx = offsetof(struct compose, element);
+	unsigned delay = 0;
+	for (unsigned position = 0; position < hdr->positions; ++position) {
+		if (position == hdr->loop_position && le16(&hdr->loop) != eidx)
+			return false;
+		if (eidx < size && data[eidx] & 1<<6)
+			delay = data[eidx++] & 0x3F;
+		if (!delay || eidx >= size)
+			return false;
+		const size_t pattern = pattern_table + (data[eidx] & 0x7F) * sizeof(struct pattern);
+		if (!in_range(pattern, sizeof(struct pattern), size))
+			return false;
+		const struct pattern *pt = (const void*)&data[pattern];
+		if (le16(&pt->envelope_data) >= size)
+			return false;
+		for (int cn = A; cn <= C; ++cn) {
+			if (le16(&pt->channel[cn]) >= size)
+				return false;
+		}
+		eidx += data[eidx] & 1<<7 ? 4 : 1;
+	}
+	return eidx <= size;
+}
+
+bool cps_compile(const uint8_t *data, size_t data_size, struct ay_timeline *tl)
+{
+	if (!cps_validate(data, data_size))
+		return false;
+	struct sequencer sq;
+	sequencer_init(&sq, data, data_size);
+	struct ay_regs regs = { .shape = ay_shape_keep };
+	struct ay_regs *frames = NULL;
+	unsigned size = 0, capacity = 0;
+	// Кадры, в которых начинаются позиции.
+	unsigned *starts = NULL;
+	unsigned patterns = 0, patterns_capacity = 0;
+	// Состояние перед кадром, с которого композиция повторялась в последний раз.
+	struct sequencer loop_sq   = sq;
+	struct ay_regs   loop_regs = regs;
+	int loop_frame = -1, prev_loop_frame = -1;
+	for (;;) {
+		const struct sequencer prev_sq = sq;
+		const struct ay_regs prev_regs = regs;
+		const bool looped = sequencer_frame(&sq, &regs);
+		if (sq.overrun) {
+			free(frames);
+			free(starts);
+			return false;
+		}
+		if (looped || sq.frame == sq.loop_frame) {
+			if (loop_frame >= 0 && sequencer_equal(&prev_sq, &loop_sq)
+			 && regs_equal(&prev_regs, &loop_regs))
+				break;
+			loop_sq    = prev_sq;
+			loop_regs  = prev_regs;
+			prev_loop_frame = loop_frame;
+			loop_frame = size;
+		}
+		if (size == capacity) {
+			capacity = capacity ? 2 * capacity : 1024;
+			struct ay_regs *f = capacity <= ay_max_frames
+			                  ? realloc(frames, capacity * sizeof(*frames)) : NULL;
+			if (!f) {
+				free(frames);
+				free(starts);
+				return false;
+			}
+			frames = f;
+		}
+		if (looped || sq.position != prev_sq.position) {
+			if (patterns == patterns_capacity) {
+				patterns_capacity = patterns_capacity ? 2 * patterns_capacity : 64;
+				unsigned *s = realloc(starts, patterns_capacity * sizeof(*starts));
+				if (!s) {
+					free(frames);
+					free(starts);
+					return false;
+				}
+				starts = s;
+			}
+			starts[patterns++] = size;
+		}
+		frames[size++] = regs;
+		regs.shape = ay_shape_keep;
+	}
+	// Обычно уже второе исполнение повторяемой части лишь отличается состоянием
+	// секвенсора, но не значениями регистров. Тогда оно излишне.
+	bool repeated = prev_loop_frame >= 0 && size - loop_frame == loop_frame - prev_loop_frame;
+	for (unsigned f = loop_frame; repeated && f < size; ++f)
+		repeated = regs_equal(&frames[f], &frames[f - (size - loop_frame)]);
+	if (repeated) {
+		size = loop_frame;
+		loop_frame = prev_loop_frame;
+	}
+	while (patterns && starts[patterns - 1] >= size)
+		--patterns;
+
+	const bool packed = ay_timeline_pack(tl, frames, size, loop_frame, starts, patterns);
+	free(frames);
+	free(starts);
+	return packed;
+}
+
+bool ay_timeline_pack(struct ay_timeline *tl, const struct ay_regs *frames, unsigned size,
+                      unsigned loop_frame, const unsigned *starts, unsigned patterns)
+{
+	// Раскладываем по массивам регистров одним блоком.
+	uint16_t *r16 = malloc(size * (ay_channels + 1) * sizeof(uint16_t)
+	                     + patterns * sizeof(unsigned)
+	                     + size * (ay_channels + 3) * sizeof(uint8_t));
+	if (!r16)
+		return false;
+	// Регистры uint16_t занимают 8 байт на кадр, что выравнивает unsigned.
+	unsigned *pattern_frame = (unsigned*)(r16 + size * (ay_channels + 1));
+	memcpy(pattern_frame, starts, patterns * sizeof(unsigned));
+	uint8_t *r8 = (uint8_t*)(pattern_frame + patterns);
+	uint16_t *tone[ay_channels], *envelope = r16 + ay_channels * size;
+	uint8_t *volume[ay_channels], *noise = r8, *mixer = r8 + size, *shape = r8 + 2 * size;
+	for (int cn = A; cn <= C; ++cn) {
+		tone[cn]   = r16 + cn * size;
+		volume[cn] = r8 + (3 + cn) * size;
+	}
+	for (unsigned f = 0; f < size; ++f) {
+		for (int cn = A; cn <= C; ++cn) {
+			tone[cn][f]   = frames[f].tone[cn];
+			volume[cn][f] = frames[f].volume[cn];
+		}
+		noise[f]    = frames[f].noise;
+		mixer[f]    = frames[f].mixer;
+		envelope[f] = frames[f].envelope;
+		shape[f]    = frames[f].shape;
+	}
+	*tl = (struct ay_timeline) {
+		.frames        = size,
+		.loop_frame    = loop_frame,
+		.tone          = { tone[A], tone[B], tone[C] },
+		.noise         = noise,
+		.mixer         = mixer,
+		.volume        = { volume[A], volume[B], volume[C] },
+		.envelope      = envelope,
+		.shape         = shape,
+		.patterns      = patterns,
+		.pattern_frame = pattern_frame,
+	};
+	return true;
+}
+
+void cps_timeline_free(struct ay_timeline *tl)
+{
+	// Все массивы размещены в блоке, начинающемся с tone[A].
+	free((void*)tl->tone[A]);
+	*tl = (struct ay_timeline) { 0 };
+}
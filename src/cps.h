@@ -0,0 +1,129 @@
+/**\file
+ * \brief	Композиции CPS и последовательности значений регистров AY.
+ *
+ *  Композиция заранее компилируется в значения регистров на каждый кадр
+ *  (1/50 сек), проигрывателю остаётся лишь выбирать их по номеру кадра.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+	A = 0, B, C,	ay_channels,
+
+	/// Значение ay_regs.shape: регистр формы огибающей в кадре не записывается.
+	ay_shape_keep	= 0xFF,
+	/// Предел длительности последовательности в кадрах (около 5 часов).
+	ay_max_frames	= 1 << 20,
+};
+
+/** Значения регистров AY-3-8912 в кадре. */
+struct ay_regs {
+	/** R0–R5: периоды тона каналов (12 бит)                          */
+	uint16_t	tone[ay_channels];
+	/** R6: период шума (5 бит)                                        */
+	uint8_t 	noise;
+	/** R7: запрет тона (биты 0–2) и шума (биты 3–5) каналов           */
+	uint8_t 	mixer;
+	/** R8–R10: громкости каналов, бит 4 — громкость задаёт огибающая */
+	uint8_t 	volume[ay_channels];
+	/** R11–R12: период огибающей                                      */
+	uint16_t	envelope;
+	/** R13: форма огибающей, запись перезапускает огибающую           */
+	uint8_t 	shape;
+};
+
+/** Значения регистров по кадрам композиции (структура массивов). */
+struct ay_timeline {
+	/** Кадров до перехода к loop_frame  */
+	unsigned      	frames;
+	/** Кадр, с которого композиция повторяется */
+	unsigned      	loop_frame;
+	const uint16_t	*tone[ay_channels];
+	const uint8_t 	*noise;
+	const uint8_t 	*mixer;
+	const uint8_t 	*volume[ay_channels];
+	const uint16_t	*envelope;
+	const uint8_t 	*shape;
+	/** Шаблонов, начатых до frames, включая повторные */
+	unsigned      	patterns;
+	/** Кадры, в которых начинаются шаблоны, по возрастанию */
+	const unsigned	*pattern_frame;
+};
+
+/** Значения регистров в кадре frame. */
+static inline void ay_timeline_regs(const struct ay_timeline *tl, unsigned frame,
+                                    struct ay_regs *regs)
+{
+	for (int cn = A; cn <= C; ++cn) {
+		regs->tone[cn]   = tl->tone[cn][frame];
+		regs->volume[cn] = tl->volume[cn][frame];
+	}
+	regs->noise    = tl->noise[frame];
+	regs->mixer    = tl->mixer[frame];
+	regs->envelope = tl->envelope[frame];
+	regs->shape    = tl->shape[frame];
+}
+
+/** Записывает значение v в регистр r; запись в порты ввода-вывода R14–R15 пропускается. */
+static inline void ay_regs_set(struct ay_regs *regs, unsigned r, uint8_t v)
+{
+	switch (r) {
+	case 0: case 2: case 4:
+		regs->tone[r / 2] = (regs->tone[r / 2] & 0xF00) | v;
+		break;
+	case 1: case 3: case 5:
+		regs->tone[r / 2] = (regs->tone[r / 2] & 0x0FF) | (v & 0x0F) << 8;
+		break;
+	case 6:
+		regs->noise = v & 0x1F;
+		break;
+	case 7:
+		// Разряды 6–7 управляют портами ввода-вывода.
+		regs->mixer = v & 0x3F;
+		break;
+	case 8: case 9: case 10:
+		regs->volume[r - 8] = v & 0x1F;
+		break;
+	case 11:
+		regs->envelope = (regs->envelope & 0xFF00) | v;
+		break;
+	case 12:
+		regs->envelope = (regs->envelope & 0x00FF) | v << 8;
+		break;
+	case 13:
+		regs->shape = v & 0x0F;
+		break;
+	}
+}
+
+/**
+ * Проверяет заголовок композиции CPS размером size: позиции, таблицы
+ * шаблонов и инструментов должны лежать в пределах данных. Сэмплы и орнаменты
+ * проверяются cps_compile() при выборе, т.к. смещения неиспользуемых
+ * инструментов произвольны.
+ */
+bool cps_validate(const uint8_t *data, size_t size);
+
+/**
+ * Проигрывает композицию CPS секвенсором и сохраняет значения регистров.
+ * Последовательность продолжается, пока состояние секвенсора при переходе
+ * к позиции повтора не совпадёт с предыдущим, поэтому повтор с loop_frame
+ * в точности воспроизводит композицию.
+ * Массивы размещаются одним блоком, освобождаемым cps_timeline_free().
+ * \return false при ошибке в данных, нехватке памяти или бесконечной композиции.
+ */
+bool cps_compile(const uint8_t *data, size_t size, struct ay_timeline *tl);
+
+/**
+ * Раскладывает size кадров frames и начала шаблонов starts по массивам tl
+ * одним блоком, освобождаемым cps_timeline_free().
+ * \return false при нехватке памяти.
+ */
+bool ay_timeline_pack(struct ay_timeline *tl, const struct ay_regs *frames, unsigned size,
+                      unsigned loop_frame, const unsigned *starts, unsigned patterns);
+
+void cps_timeline_free(struct ay_timeline *tl);
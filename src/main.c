@@ -33,9 +33,11 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <time.h>
 #include <linux/input-event-codes.h>
@@ -43,6 +45,7 @@
 #include "ay_music.h"
 #include "vulkan.h"
 #include "polygon.h"
+#include "sfx.h"
 #include "text.h"
 #include "window.h"
 
@@ -72,6 +75,8 @@
 #define COLOR_STOP      	((struct color){ 0.90f, 0.90f, 0.00f, 0.90f })
 #define COLOR_EXIT      	((struct color){ 0.90f, 0.00f, 0.00f, 0.90f })
 #define COLOR_BACKGROUND	((struct color){ 0.10f, 0.10f, 0.10f, 0.25f })
+#define COLOR_SCOPE     	((struct color){ 0.00f, 0.60f, 0.90f, 0.40f })
+#define COLOR_LEVEL     	((struct color){ 0.00f, 0.40f, 0.00f, 0.50f })
 
 const char game_name[] = "Охота на лис";
 
@@ -192,6 +197,7 @@ static void board_check(int x, int y)
 	if (open->open < INT_MAX)
 		++open->open;
 	const bool found = open->fox > open->found;
+	sfx_play(found ? sfx_fox : sfx_probe);
 	if (found) {
 		++open->found;
 		++fox_found;
@@ -360,10 +366,35 @@ static inline void colorer_title(struct vertex *restrict vert, struct color src,
 	}
 }
 
-static void title(struct draw_ctx *restrict ctx, struct vec4 at)
+/**
+ * Громкости каналов AY столбиками вдоль нижнего края области hw×hh и
+ * осциллограмма звука поверх них.
+ */
+static void scope_draw(struct draw_ctx *restrict ctx, struct vec4 at, float hw, float hh,
+                       const struct ay_scope *scope)
+{
+	const unsigned bars = scope->chips * 3;
+	for (unsigned b = 0; b < bars; ++b) {
+		const float h = hh * scope->level[b / 3][b % 3] / 15.0f;
+		const struct vec4 bar = {
+			at.x - hw + (b + 0.5f) * 2.0f * hw / bars, at.y + hh - h, at.z, at.w
+		};
+		rectangle(ctx, bar, 0.4f * hw / bars, h, COLOR_LEVEL);
+	}
+	for (unsigned i = 0; i < ay_scope_points; ++i) {
+		const struct vec4 dot = {
+			at.x - hw + (i + 0.5f) * 2.0f * hw / ay_scope_points,
+			at.y - hh * scope->wave[i] / 32768.0f, at.z, at.w
+		};
+		rectangle(ctx, dot, hw / ay_scope_points, 0.05f, COLOR_SCOPE);
+	}
+}
+
+static void title(struct draw_ctx *restrict ctx, struct vec4 at, const struct ay_scope *scope)
 {
 	omega_title = omega_title < 2.0f*PI ? omega_title + PI/1024.0f : 0;
 	rectangle(ctx, at, 4.53f, 2.5f, COLOR_BOX);
+	scope_draw(ctx, at, 4.53f, 2.5f, scope);
 	static const char *const text[] = {
 		"ОХОТА",
 		"НА ЛИС",
@@ -629,25 +660,29 @@ static void game_start(void)
 	time_init();
 	srand(start_time.tv_nsec ^ start_time.tv_sec);
 	board_init();
-	ay_music_select(1);
+	// Загруженные композиции (после встроенных 0 и 1) выбираются случайно.
+	const int musics = ay_music_count();
+	if (musics <= 2 || !ay_music_select(2 + rand() % (musics - 2)))
+		ay_music_select(1);
 }
 
 static void game_stop(void)
 {
 	game_state = gs_intro;
-	ay_music_select(0);
+	// Заставка продолжается с шаблона, на котором её прервала игра.
+	ay_music_resume(0);
 }
 
 static bool draw_frame(void *p)
 {
-	ay_music_continue(5);
-
 	struct vk_context *vk = p;
 	// В X11 ожидание обеспечивает синхронизацию с развёрткой.
 	VkResult r = vk_acquire_frame(vk, UINT64_MAX);
 	if (r != VK_SUCCESS)
 		return false;
 
+	// Снимок звука один на обе стадии, иначе размеры буферов разойдутся.
+	const struct ay_scope *scope = ay_music_scope();
 	// На стадии 0 вычисляем размер буферов, на следующей их заполняем.
 	unsigned total_indices;
 	unsigned total_vertices;
@@ -687,7 +722,7 @@ static bool draw_frame(void *p)
 
 		const float tw = 18.5f;
 		const float twa = tw / aspect_ratio;
-		title(&dc, (struct vec4){ twa, -0.7f * twa, 0.0f, tw });
+		title(&dc, (struct vec4){ twa, -0.7f * twa, 0.0f, tw }, scope);
 
 		const float sw = 15.0f * aspect_ratio;
 		score(&dc, (struct vec4){ sw/aspect_ratio, 0.05f * sw, 0.0f, sw });
@@ -735,6 +770,8 @@ static bool pointer_click(struct window *window, double x, double y,
 			goto over;
 		}
 		if (button_over(&button_start, xh, yh, button, state)) {
+			if (button_start.click)
+				sfx_play(sfx_click);
 			if (button_start.release)
 				switch (game_state) {
 				case gs_finish:
@@ -777,12 +814,61 @@ static const struct render vulkan = {
 	.resize    	= vk_window_resize,
 };
 
+/** Музыка звучит, только пока окно видно. */
+static void visibility(struct window *window, bool visible)
+{
+	ay_music_pause(!visible);
+}
+
 static const struct controller controller = {
-	.hover  	= pointer_over,
-	.click  	= pointer_click,
-	.touch  	= touch,
+	.hover     	= pointer_over,
+	.click     	= pointer_click,
+	.touch     	= touch,
+	.visibility	= visibility,
 };
 
+/**
+ * Однопоточный цикл: ожидает в poll() сообщений сервера и готовности
+ * звукового устройства, музыка синтезируется здесь же. Если вывод звука
+ * прекращён, *music сбрасывается и игра продолжается без музыки, как
+ * при завершении потока синтеза.
+ * \return false при разрыве соединения с сервером.
+ */
+static bool poll_dispatch(bool *music)
+{
+	enum { max_fds = 8 };
+	struct pollfd fds[max_fds] = { { .fd = wp_fd(), .events = POLLIN } };
+	if (!wp_prepare_read())
+		return false;
+	const int nfds = 1 + (*music ? ay_music_poll_descriptors(fds + 1, max_fds - 1) : 0);
+	if (poll(fds, nfds, -1) < 0) {
+		wp_read_events(false);
+		return errno == EINTR;
+	}
+	if (nfds > 1 && !ay_music_poll(fds + 1, nfds - 1)) {
+		fprintf(stderr, "Вывод музыки прекращён.\n");
+		*music = false;
+	}
+	return wp_read_events(fds[0].revents);
+}
+
+/** Выбирает способ синтеза музыки по названию. */
+static bool synthesis_option(const char *name)
+{
+	static const char *const synthesis[] = {
+		[ay_synth_ticks]  = "ticks",
+		[ay_synth_events] = "events",
+		[ay_synth_blep]   = "blep",
+	};
+	for (int s = 0; s < sizeof(synthesis)/sizeof(*synthesis); ++s) {
+		if (!strcmp(name, synthesis[s])) {
+			ay_music_synthesis(s);
+			return true;
+		}
+	}
+	return false;
+}
+
 int main(int argc, char *argv[])
 {
 	int r = 0;
@@ -792,8 +878,59 @@ int main(int argc, char *argv[])
 	printf("«%s» версия " APP_VERSION " для Wayland.\n", game_name);
 #endif
 
+	const char *render_path = NULL;
+	int render_num = 0;
+	bool single_thread = false;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--synthesis") && i + 1 < argc
+		 && synthesis_option(argv[i + 1])) {
+			++i;
+		} else if (!strcmp(argv[i], "--period") && i + 1 < argc) {
+			ay_music_period(atof(argv[++i]) * 1000);
+		} else if (!strcmp(argv[i], "--ring") && i + 1 < argc) {
+			ay_music_ring(atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--realtime") && i + 1 < argc
+		        && ay_music_realtime(argv[i + 1])) {
+			++i;
+		} else if (!strcmp(argv[i], "--cpu") && i + 1 < argc) {
+			ay_music_cpu(atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--mlock")) {
+			ay_music_mlock(true);
+		} else if (!strcmp(argv[i], "--single-thread")) {
+			single_thread = true;
+		} else if (!strcmp(argv[i], "--prerender")) {
+			ay_music_prerender(true);
+		} else if (!strcmp(argv[i], "--sink") && i + 1 < argc
+		        && ay_music_sink(argv[i + 1])) {
+			++i;
+		} else if (!strcmp(argv[i], "--format") && i + 1 < argc
+		        && ay_music_format(argv[i + 1])) {
+			++i;
+		} else if (!strcmp(argv[i], "--music-dir") && i + 1 < argc) {
+			if (ay_music_load(argv[++i]) < 0)
+				return 1;
+		} else if (!strcmp(argv[i], "--render-music") && i + 2 < argc) {
+			// Номер all — все композиции в каталог.
+			render_num  = strcmp(argv[++i], "all") ? atoi(argv[i]) : -1;
+			render_path = argv[++i];
+		} else {
+			fprintf(stderr, "Использование: %s [--synthesis ticks|events|blep] [--prerender] [--ring кадров]"
+			                " [--period мс] [--realtime fifo|rr[:приоритет]] [--cpu номер] [--mlock]"
+			                " [--single-thread] [--music-dir каталог]"
+			                " [--sink alsa[:устройство]|null|wav:файл|stdout] [--format s16|s32|float]"
+			                " [--render-music номер файл[.wav|.psg] | all каталог]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (render_path && render_num < 0)
+		return ay_music_render_all(render_path) < 0 ? 4 : 0;
+	if (render_path)
+		return ay_music_render(render_num, render_path) < 0 ? 4 : 0;
+
 	bool music = ay_music_init() >= 0;
-	if (music)
+	if (music && single_thread)
+		ay_music_play_polled();
+	else if (music)
 		ay_music_play();
 
 	if (!wp_init()) {
@@ -834,8 +971,10 @@ int main(int argc, char *argv[])
 		goto exit_vk;
 	}
 
+	// В однопоточном режиме вывод музыки опрашивается, пока он не прекращён.
+	bool music_polled = music;
 	while(!window.close) {
-		if (!wp_dispatch())
+		if (!(single_thread ? poll_dispatch(&music_polled) : wp_dispatch()))
 			break;
 	}
 	window_destroy(&window);
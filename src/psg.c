@@ -0,0 +1,155 @@
+/**\file
+ * \brief	Записи значений регистров AY в формате PSG.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "psg.h"
+
+enum {
+	/// Длина заголовка; далее следуют записи.
+	psg_header	= 16,
+	/// Регистров AY-3-8912, кроме портов ввода-вывода R14–R15.
+	psg_regs  	= 14,
+	/// Команды потока записей.
+	psg_end   	= 0xFD,
+	psg_skip  	= 0xFE,
+	psg_frame 	= 0xFF,
+};
+
+static const uint8_t psg_magic[4] = { 'P', 'S', 'G', 0x1A };
+
+bool psg_validate(const uint8_t *data, size_t size)
+{
+	return size >= psg_header && !memcmp(data, psg_magic, sizeof(psg_magic));
+}
+
+/** Значения регистров R0–R12 (R13 записывается лишь при перезапуске огибающей). */
+static void regs_get(const struct ay_regs *regs, uint8_t r[psg_regs])
+{
+	for (int cn = A; cn <= C; ++cn) {
+		r[2 * cn]     = regs->tone[cn] & 0xFF;
+		r[2 * cn + 1] = regs->tone[cn] >> 8;
+		r[8 + cn]     = regs->volume[cn];
+	}
+	r[6]  = regs->noise;
+	r[7]  = regs->mixer;
+	r[11] = regs->envelope & 0xFF;
+	r[12] = regs->envelope >> 8;
+	r[13] = regs->shape;
+}
+
+bool psg_compile(const uint8_t *data, size_t size, struct ay_timeline *tl)
+{
+	if (!psg_validate(data, size))
+		return false;
+	struct ay_regs regs = { .shape = ay_shape_keep };
+	struct ay_regs *frames = NULL;
+	unsigned count = 0, capacity = 0;
+	// Значения записаны после последнего завершённого кадра.
+	bool pending = false;
+	for (size_t i = psg_header; i < size && data[i] != psg_end;) {
+		const uint8_t cmd = data[i++];
+		unsigned repeat;
+		if (cmd == psg_frame) {
+			repeat = 1;
+		} else if (cmd == psg_skip && i < size) {
+			repeat = 4 * data[i++];
+		} else if (cmd < 16 && i < size) {
+			ay_regs_set(&regs, cmd, data[i++]);
+			pending = true;
+			continue;
+		} else if (i == size) {
+			// Запись оборвана посреди команды.
+			break;
+		} else {
+			free(frames);
+			return false;
+		}
+		if (count + repeat > capacity) {
+			while (count + repeat > capacity)
+				capacity = capacity ? 2 * capacity : 1024;
+			struct ay_regs *f = capacity <= ay_max_frames
+			                  ? realloc(frames, capacity * sizeof(*frames)) : NULL;
+			if (!f) {
+				free(frames);
+				return false;
+			}
+			frames = f;
+		}
+		for (; repeat; --repeat) {
+			frames[count++] = regs;
+			regs.shape = ay_shape_keep;
+		}
+		pending = false;
+	}
+	if (pending && count < ay_max_frames) {
+		struct ay_regs *f = realloc(frames, (count + 1) * sizeof(*frames));
+		if (!f) {
+			free(frames);
+			return false;
+		}
+		frames = f;
+		frames[count++] = regs;
+	}
+	if (!count) {
+		free(frames);
+		return false;
+	}
+	// В записи нет шаблонов — переход выполняется к началу равных отрезков.
+	const unsigned patterns = (count + psg_pattern_frames - 1) / psg_pattern_frames;
+	unsigned *starts = malloc(patterns * sizeof(*starts));
+	for (unsigned p = 0; starts && p < patterns; ++p)
+		starts[p] = p * psg_pattern_frames;
+	const bool packed = starts && ay_timeline_pack(tl, frames, count, 0, starts, patterns);
+	free(frames);
+	free(starts);
+	return packed;
+}
+
+/** Записывает ожидание waits кадров. */
+static void psg_wait(FILE *out, unsigned waits)
+{
+	for (; waits >= 4; ) {
+		const unsigned n = waits / 4 < 0xFF ? waits / 4 : 0xFF;
+		putc(psg_skip, out);
+		putc(n, out);
+		waits -= 4 * n;
+	}
+	for (; waits; --waits)
+		putc(psg_frame, out);
+}
+
+bool psg_write(FILE *out, const struct ay_timeline *tl)
+{
+	// Версия формата и частота прерываний, Гц.
+	uint8_t header[psg_header] = { [4] = 0x10, [5] = 50 };
+	memcpy(header, psg_magic, sizeof(psg_magic));
+	fwrite(header, sizeof(header), 1, out);
+	uint8_t prev[psg_regs];
+	// Кадры, завершение которых ещё не записано.
+	unsigned waits = 0;
+	for (unsigned f = 0; f < tl->frames; ++f) {
+		struct ay_regs regs;
+		uint8_t r[psg_regs];
+		ay_timeline_regs(tl, f, &regs);
+		regs_get(&regs, r);
+		bool changed = false;
+		for (unsigned n = 0; n < psg_regs; ++n) {
+			const bool write = n == 13 ? regs.shape != ay_shape_keep : !f || r[n] != prev[n];
+			if (!write)
+				continue;
+			if (!changed)
+				psg_wait(out, waits);
+			putc(n, out);
+			putc(r[n], out);
+			changed = true;
+		}
+		memcpy(prev, r, sizeof(prev));
+		waits = changed ? 1 : waits + 1;
+	}
+	psg_wait(out, waits);
+	putc(psg_end, out);
+	return !ferror(out);
+}
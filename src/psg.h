@@ -0,0 +1,40 @@
+/**\file
+ * \brief	Записи значений регистров AY в формате PSG.
+ *
+ *  Файл PSG — заголовок «PSG\x1A» длиной 16 байт и поток записей: пары
+ *  «номер регистра (0–15), значение»; 0xFF завершает кадр (1/50 сек),
+ *  0xFE n повторяет кадр 4·n раз, 0xFD завершает запись. Как и композиция
+ *  CPS, запись заранее раскладывается по кадрам в struct ay_timeline.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cps.h"
+
+enum {
+	/// Длина шаблона записи PSG для перехода по ay_music_seek(), кадров (5 сек).
+	psg_pattern_frames	= 250,
+};
+
+/** Проверяет заголовок записи PSG размером size. */
+bool psg_validate(const uint8_t *data, size_t size);
+
+/**
+ * Раскладывает запись PSG по кадрам. Запись повторяется с начала, а для
+ * перехода по ay_music_seek() делится на шаблоны по psg_pattern_frames кадров.
+ * Массивы размещаются одним блоком, освобождаемым cps_timeline_free().
+ * \return false при ошибке в данных, нехватке памяти или пустой записи.
+ */
+bool psg_compile(const uint8_t *data, size_t size, struct ay_timeline *tl);
+
+/**
+ * Записывает значения регистров tl в файл out в формате PSG: в каждом кадре
+ * лишь изменившиеся регистры, неизменные кадры подряд — командой 0xFE.
+ * \return false при ошибке записи.
+ */
+bool psg_write(FILE *out, const struct ay_timeline *tl);
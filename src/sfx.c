@@ -0,0 +1,159 @@
+/**\file
+ * \brief	Звуковые эффекты, смешиваемые с музыкой AY.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "sfx.h"
+
+enum {
+	/// Одновременно звучащих эффектов.
+	sfx_voices	= 8,
+	/// Ёмкость очереди команд, степень 2.
+	sfx_queue 	= 16,
+	/// Амплитуда меандра эффекта, около четверти полной шкалы.
+	sfx_volume	= 0x2000,
+};
+
+/** Нота эффекта: меандр с линейно затухающей громкостью. */
+struct sfx_note {
+	unsigned	frequency;	///< Гц, 0 — конец эффекта
+	unsigned	ms;
+};
+
+static const struct sfx_note *const sfx_notes[sfx_count] = {
+	[sfx_click] = (const struct sfx_note[]) {
+		{ 2000, 8 }, { 0 },
+	},
+	[sfx_probe] = (const struct sfx_note[]) {
+		{ 880, 40 }, { 660, 60 }, { 0 },
+	},
+	[sfx_fox]   = (const struct sfx_note[]) {
+		{ 523, 60 }, { 659, 60 }, { 784, 60 }, { 1047, 150 }, { 0 },
+	},
+};
+
+/** Эффект, синтезированный в память. */
+static struct {
+	lr32    	*pcm;
+	unsigned	size;
+} sfx_pcm[sfx_count];
+
+/** Голос: воспроизводимый эффект и положение в нём. */
+static struct voice {
+	const lr32	*pcm;
+	unsigned  	size;
+	unsigned  	pos;
+} voices[sfx_voices];
+
+/**
+ * Очередь команд от единственного писателя (поток интерфейса) к
+ * единственному читателю (поток вывода). Счётчики только возрастают.
+ */
+static struct {
+	alignas(64) atomic_uint	head;
+	alignas(64) atomic_uint	tail;
+	alignas(64) uint8_t    	effect[sfx_queue];
+} queue;
+
+/** Синтезирует эффект по нотам в pcm (NULL — только подсчёт длины). */
+static unsigned sfx_render(const struct sfx_note *note, lr32 *pcm)
+{
+	unsigned size = 0;
+	for (; note->frequency; ++note) {
+		const unsigned n = sample_rate * note->ms / 1000;
+		// Фаза с 16 разрядами дробной части, полупериод — 0x8000.
+		const uint32_t step = ((uint64_t)note->frequency << 16) / sample_rate;
+		uint32_t phase = 0;
+		for (unsigned i = 0; pcm && i < n; ++i, phase += step) {
+			const int16_t v = (int64_t)sfx_volume * (n - i) / n;
+			pcm[size + i] = (phase & 0x8000) ? (lr32){ -v, -v } : (lr32){ v, v };
+		}
+		size += n;
+	}
+	return size;
+}
+
+bool sfx_setup(void)
+{
+	for (int i = 0; i < sfx_count; ++i) {
+		const unsigned size = sfx_render(sfx_notes[i], NULL);
+		lr32 *pcm = malloc(size * sizeof(*pcm));
+		if (!pcm)
+			return false;
+		sfx_render(sfx_notes[i], pcm);
+		sfx_pcm[i].pcm  = pcm;
+		sfx_pcm[i].size = size;
+	}
+	return true;
+}
+
+void sfx_cleanup(void)
+{
+	for (int i = 0; i < sfx_count; ++i) {
+		free(sfx_pcm[i].pcm);
+		sfx_pcm[i].pcm  = NULL;
+		sfx_pcm[i].size = 0;
+	}
+	for (int i = 0; i < sfx_voices; ++i)
+		voices[i] = (struct voice) { 0 };
+}
+
+void sfx_play(enum sfx effect)
+{
+	const unsigned head = atomic_load_explicit(&queue.head, memory_order_relaxed);
+	const unsigned tail = atomic_load_explicit(&queue.tail, memory_order_acquire);
+	if (head - tail >= sfx_queue)
+		return;
+	queue.effect[head % sfx_queue] = effect;
+	atomic_store_explicit(&queue.head, head + 1, memory_order_release);
+}
+
+/** Занимает свободный голос, либо голос, звучащий дольше всех. */
+static void voice_start(enum sfx effect)
+{
+	if (!sfx_pcm[effect].pcm)
+		return;
+	struct voice *v = &voices[0];
+	for (int i = 0; i < sfx_voices && v->pcm; ++i)
+		if (!voices[i].pcm || voices[i].pos > v->pos)
+			v = &voices[i];
+	*v = (struct voice) {
+		.pcm  = sfx_pcm[effect].pcm,
+		.size = sfx_pcm[effect].size,
+	};
+}
+
+static inline int16_t saturate(int32_t v)
+{
+	return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+}
+
+void sfx_mix(lr32 *buff, unsigned size)
+{
+	const unsigned head = atomic_load_explicit(&queue.head, memory_order_acquire);
+	unsigned tail = atomic_load_explicit(&queue.tail, memory_order_relaxed);
+	if (tail != head) {
+		for (; tail != head; ++tail)
+			voice_start(queue.effect[tail % sfx_queue]);
+		atomic_store_explicit(&queue.tail, tail, memory_order_release);
+	}
+	for (int i = 0; i < sfx_voices; ++i) {
+		struct voice *v = &voices[i];
+		if (!v->pcm)
+			continue;
+		unsigned n = v->size - v->pos;
+		if (n > size)
+			n = size;
+		const lr32 *src = &v->pcm[v->pos];
+		for (unsigned j = 0; j < n; ++j) {
+			buff[j].l = saturate(buff[j].l + src[j].l);
+			buff[j].r = saturate(buff[j].r + src[j].r);
+		}
+		v->pos += n;
+		if (v->pos == v->size)
+			v->pcm = NULL;
+	}
+}
@@ -0,0 +1,38 @@
+/**\file
+ * \brief	Звуковые эффекты, смешиваемые с музыкой AY.
+ *
+ *  Эффекты синтезируются в память при запуске. Поток интерфейса ставит их
+ *  в очередь sfx_play(), а поток вывода звука забирает команды и смешивает
+ *  звучащие голоса с фрагментом sfx_mix() без блокировок и выделения памяти.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "ay.h"
+
+/** Звуковой эффект. */
+enum sfx {
+	sfx_click,	///< Нажатие кнопки
+	sfx_probe,	///< Проверка клетки без лисы
+	sfx_fox,  	///< Найдена лиса
+	sfx_count,
+};
+
+/** Синтезирует эффекты для частоты sample_rate. \return false при нехватке памяти. */
+bool sfx_setup(void);
+
+void sfx_cleanup(void);
+
+/**
+ * Запускает эффект. Вызывается из одного потока (интерфейса); если очередь
+ * заполнена, эффект пропускается.
+ */
+void sfx_play(enum sfx effect);
+
+/**
+ * Смешивает звучащие эффекты с size дискретизациями buff с насыщением.
+ * Вызывается только потоком вывода звука.
+ */
+void sfx_mix(lr32 *buff, unsigned size);
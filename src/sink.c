@@ -0,0 +1,72 @@
+/**\file
+ * \brief	Форматы дискретизаций на выходе приёмников звука.
+ */
+
+#include <string.h>
+
+#include "sink.h"
+
+enum sample_format	sample_format = sample_s16;
+bool              	sample_format_fixed;
+
+const char *const sample_format_names[sample_formats] = {
+	[sample_s16]  	= "s16",
+	[sample_s32]  	= "s32",
+	[sample_float]	= "float",
+};
+
+size_t sample_bytes(enum sample_format format)
+{
+	return format == sample_s16 ? sizeof(lr32) : channels * 4;
+}
+
+void sample_convert(void *restrict dst, const lr32 *restrict src, size_t n)
+{
+	switch (sample_format) {
+	case sample_s16:
+		memcpy(dst, src, n * sizeof(*src));
+		break;
+	case sample_s32: {
+		int32_t *restrict out = dst;
+		for (size_t i = 0; i < n; ++i) {
+			out[2*i + L] = src[i].l * 65536;
+			out[2*i + R] = src[i].r * 65536;
+		}
+		break;
+	}
+	case sample_float: {
+		float *restrict out = dst;
+		for (size_t i = 0; i < n; ++i) {
+			out[2*i + L] = src[i].l * (1.0f / 32768);
+			out[2*i + R] = src[i].r * (1.0f / 32768);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+/** Записывает целое в порядке little-endian. */
+static void put_le(uint8_t *dst, uint32_t v, int bytes)
+{
+	for (int i = 0; i < bytes; ++i)
+		dst[i] = v >> (8 * i);
+}
+
+void wav_header(uint8_t hdr[44], enum sample_format format, uint32_t size)
+{
+	const unsigned bytes = sample_bytes(format);
+	memcpy(&hdr[0],  "RIFF", 4);
+	put_le(&hdr[4],  36 + size, 4);
+	memcpy(&hdr[8],  "WAVEfmt ", 8);
+	put_le(&hdr[16], 16, 4);
+	put_le(&hdr[20], format == sample_float ? 3 : 1, 2);	// IEEE float : PCM
+	put_le(&hdr[22], channels, 2);
+	put_le(&hdr[24], sample_rate, 4);
+	put_le(&hdr[28], sample_rate * bytes, 4);
+	put_le(&hdr[32], bytes, 2);
+	put_le(&hdr[34], 8 * bytes / channels, 2);
+	memcpy(&hdr[36], "data", 4);
+	put_le(&hdr[40], size, 4);
+}
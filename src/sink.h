@@ -0,0 +1,98 @@
+/**\file
+ * \brief	Вывод синтезированного звука.
+ *
+ *  Приёмник выбирается при запуске: звуковое устройство ALSA, либо вывод
+ *  без звуковой карты (ничего, файл WAV, стандартный вывод), темп которого
+ *  задают часы CLOCK_MONOTONIC.
+ */
+
+#pragma once
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ay.h"
+
+/** Интерфейс приёмника звука. Все функции, кроме open, вызываются после успешного open. */
+struct sink {
+	/** Имя для выбора приёмника                    */
+	const char	*name;
+	/**
+	 * Открывает приёмник с параметром arg (может быть NULL) и буфером
+	 * на 2 фрагмента длительностью period_time мкс.
+	 * Может изменить sample_rate на поддерживаемую частоту.
+	 * \return отрицательное значение при ошибке
+	 */
+	int  (*open)(const char *arg, unsigned period_time);
+	void (*close)(void);
+	/**
+	 * Ожидает места для фрагмента длиной period_size и предоставляет его
+	 * непосредственно в буфере приёмника, либо возвращает NULL — тогда
+	 * фрагмент передаётся write().
+	 */
+	lr32 *(*begin)(void);
+	/** Передаёт фрагмент, предоставленный begin().  */
+	bool (*commit)(lr32 *buff);
+	/**
+	 * Выводит size дискретизаций, ожидая места в буфере приёмника.
+	 * \return false, если продолжать вывод не имеет смысла
+	 */
+	bool (*write)(const lr32 *buff, size_t size);
+	/** Сбрасывает недоигранное на время паузы      */
+	void (*drop)(void);
+	/** Возобновляет вывод после drop()             */
+	void (*prepare)(void);
+	/**
+	 * Заполняет не более space дескрипторов для poll(), готовых к записи,
+	 * когда в буфере есть место.
+	 */
+	int  (*poll_descriptors)(struct pollfd *fds, int space);
+	/**
+	 * Обрабатывает результат poll() для дескрипторов poll_descriptors().
+	 * \return положительное значение, если в буфере появилось место, 0, если
+	 *         нет (или ошибка устранена), отрицательное, если продолжать вывод
+	 *         не имеет смысла
+	 */
+	int  (*poll_revents)(struct pollfd *fds, int count);
+	/**
+	 * Свободное место в буфере приёмника в дискретизациях, 0 после
+	 * устранённой ошибки.
+	 * \return отрицательное значение, если продолжать вывод не имеет смысла
+	 */
+	long (*avail)(void);
+};
+
+/** Дискретизаций во фрагменте, передаваемом приёмнику. */
+extern unsigned period_size;
+
+extern const struct sink alsa_sink;
+extern const struct sink null_sink;
+extern const struct sink wav_sink;
+extern const struct sink stdout_sink;
+
+/** Формат дискретизаций, передаваемых приёмником дальше. */
+enum sample_format {
+	sample_s16,  	///< Формат синтеза, без преобразования
+	sample_s32,
+	sample_float,
+	sample_formats,
+};
+
+/**
+ * Формат вывода. Приёмник ALSA выбирает родной формат устройства, если
+ * формат не задан явно (sample_format_fixed).
+ */
+extern enum sample_format	sample_format;
+extern bool              	sample_format_fixed;
+extern const char *const 	sample_format_names[sample_formats];
+
+/** Байт на дискретизацию всех каналов в формате format. */
+size_t sample_bytes(enum sample_format format);
+
+/** Преобразует n дискретизаций src в формат sample_format. */
+void sample_convert(void *restrict dst, const lr32 *restrict src, size_t n);
+
+/** Заголовок RIFF WAVE для данных формата format длиной size байт. */
+void wav_header(uint8_t hdr[44], enum sample_format format, uint32_t size);
@@ -1,6 +1,7 @@
 
 #define _GNU_SOURCE
 
+#include <errno.h>
 #include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -662,7 +663,11 @@ static const struct interface_descriptor globals[] = {
 	{ &wl_compositor_interface,	4,	(void**)&compositor },
 	{ &wl_seat_interface,      	7,	(void**)&seat       },
 	{ &wl_shm_interface,       	1,	(void**)&shared_mem },
+#ifdef XDG_TOPLEVEL_STATE_SUSPENDED_SINCE_VERSION
+	{ &xdg_wm_base_interface,  	6,	(void**)&wm_base    },
+#else
 	{ &xdg_wm_base_interface,  	1,	(void**)&wm_base    },
+#endif
 	{                          	  	                    }
 };
 
@@ -790,6 +795,7 @@ static void on_toplevel_configure(void *p, struct xdg_toplevel *toplevel,
 	// XDG_TOPLEVEL_STATE_RESIZING. Для окон с константным соотношением сторон
 	// последний случай обрабатываем отдельно.
 	bool resizing = false;
+	bool suspended = false;
 	enum xdg_toplevel_state *state;
 	wl_array_for_each(state, states) {
 		switch(*state) {
@@ -805,8 +811,16 @@ static void on_toplevel_configure(void *p, struct xdg_toplevel *toplevel,
 		case XDG_TOPLEVEL_STATE_TILED_TOP:
 		case XDG_TOPLEVEL_STATE_TILED_BOTTOM:
 			break;
+#ifdef XDG_TOPLEVEL_STATE_SUSPENDED_SINCE_VERSION
+		// Окно не видно: свёрнуто, закрыто другими окнами или экран погашен.
+		// Запросы на отрисовку кадров при этом не поступают.
+		case XDG_TOPLEVEL_STATE_SUSPENDED:
+			suspended = true;
+			break;
+#endif
 		}
 	}
+	window_visibility(window, !suspended);
 
 	// Нулевым параметром композитор указывает, что следует установить требуемый
 	// клиенту размер окна. Сигнализируем флажком для on_xdg_surface_configure().
@@ -863,9 +877,25 @@ static void on_toplevel_close(void *p, struct xdg_toplevel *toplevel)
 	window->close = true;
 }
 
+#ifdef XDG_TOPLEVEL_STATE_SUSPENDED_SINCE_VERSION
+static void on_toplevel_bounds(void *p, struct xdg_toplevel *toplevel,
+                               int32_t width, int32_t height)
+{
+}
+
+static void on_toplevel_capabilities(void *p, struct xdg_toplevel *toplevel,
+                                     struct wl_array *capabilities)
+{
+}
+#endif
+
 const static struct xdg_toplevel_listener toplevel_listener = {
-	.configure = on_toplevel_configure,
-	.close     = on_toplevel_close,
+	.configure       	= on_toplevel_configure,
+	.close           	= on_toplevel_close,
+#ifdef XDG_TOPLEVEL_STATE_SUSPENDED_SINCE_VERSION
+	.configure_bounds	= on_toplevel_bounds,
+	.wm_capabilities 	= on_toplevel_capabilities,
+#endif
 };
 
 
@@ -897,6 +927,35 @@ bool wayland_dispatch(void)
 	return wl_display_dispatch(display) >= 0;
 }
 
+int wayland_fd(void)
+{
+	return wl_display_get_fd(display);
+}
+
+bool wayland_prepare_read(void)
+{
+	while (wl_display_prepare_read(display) != 0) {
+		if (wl_display_dispatch_pending(display) < 0)
+			return false;
+	}
+	// При переполнении буфера (EAGAIN) остаток уйдёт на следующей итерации.
+	if (wl_display_flush(display) < 0 && errno != EAGAIN) {
+		wl_display_cancel_read(display);
+		return false;
+	}
+	return true;
+}
+
+bool wayland_read_events(bool readable)
+{
+	if (!readable) {
+		wl_display_cancel_read(display);
+		return true;
+	}
+	return wl_display_read_events(display) >= 0
+	    && wl_display_dispatch_pending(display) >= 0;
+}
+
 void window_destroy(struct window *window)
 {
 	if (window->render->destroy && window->render_ctx)
@@ -59,9 +59,9 @@ struct window {
 
 	/** Окно требует закрытия               */
 	bool                	close;
-#ifdef FH_PLATFORM_XCB
 	/** Видимо ли окно                      */
 	bool                	visible;
+#ifdef FH_PLATFORM_XCB
 	/** Перемещение инициировано кликом на клиентскую область */
 	bool                	moving_by_client_area;
 #else
@@ -106,8 +106,21 @@ struct controller {
 
 	/** Нажатие на сенсорный экран. */
 	void (*touch)(struct window *window, double x, double y);
+
+	/** Окно скрыто или вновь отображается (необязательно). */
+	void (*visibility)(struct window *window, bool visible);
 };
 
+/** Запоминает видимость окна и сообщает о её изменении контроллеру. */
+static inline void window_visibility(struct window *window, bool visible)
+{
+	if (window->visible == visible)
+		return;
+	window->visible = visible;
+	if (window->ctrl && window->ctrl->visibility)
+		window->ctrl->visibility(window, visible);
+}
+
 /** Инициализирует сеанс и интерфейсы для связи с сервером. */
 static inline bool wp_init(void);
 
@@ -119,6 +132,23 @@ static inline bool wp_dispatch(void);
 /** Завершает соединение с сервером и освобождает связанные ресурсы. */
 static inline void wp_stop(void);
 
+/**
+ * Для собственного цикла ожидания в poll() вместо wp_dispatch().
+ * \return дескриптор соединения с сервером.
+ */
+static inline int wp_fd(void);
+
+/** Обрабатывает уже полученные сообщения и отправляет запросы перед poll().
+ * \return false в случае ошибки.
+ */
+static inline bool wp_prepare_read(void);
+
+/** Читает и обрабатывает сообщения после poll(), если readable.
+ *  Вызывается после каждого wp_prepare_read().
+ * \return false в случае ошибки.
+ */
+static inline bool wp_read_events(bool readable);
+
 /** Создаёт окно и связанные объекты */
 bool window_create(struct window *window);
 
@@ -144,18 +174,29 @@ static inline void window_geometry(struct window *window)
 
 bool xcb_init(void);
 bool xcb_dispatch(void);
+bool xcb_dispatch_pending(void);
+int  xcb_fd(void);
 void xcb_stop(void);
 bool wp_init(void) { return xcb_init(); }
 bool wp_dispatch(void) { return xcb_dispatch(); }
 void wp_stop(void) { xcb_stop(); }
+int  wp_fd(void) { return xcb_fd(); }
+bool wp_prepare_read(void) { return xcb_dispatch_pending(); }
+bool wp_read_events(bool readable) { return !readable || xcb_dispatch_pending(); }
 
 #else
 
 bool wayland_init(void);
 bool wayland_dispatch(void);
+bool wayland_prepare_read(void);
+bool wayland_read_events(bool readable);
+int  wayland_fd(void);
 void wayland_stop(void);
 bool wp_init(void) { return wayland_init(); }
 bool wp_dispatch(void) {	return wayland_dispatch(); }
 void wp_stop(void) { wayland_stop(); }
+int  wp_fd(void) { return wayland_fd(); }
+bool wp_prepare_read(void) { return wayland_prepare_read(); }
+bool wp_read_events(bool readable) { return wayland_read_events(readable); }
 
 #endif//#ifdef FH_PLATFORM_XCB
@@ -288,6 +288,9 @@ bool window_create(struct window *window)
 		///\see xcb_dispatch()
 		if (window->render->resize)
 			event_mask |= XCB_EVENT_MASK_RESIZE_REDIRECT;
+		// XCB_VISIBILITY_NOTIFY не приходит при сворачивании окна.
+		if (window->ctrl->visibility)
+			event_mask |= XCB_EVENT_MASK_STRUCTURE_NOTIFY;
 	}
 	const uint32_t value_list[] = {
 		XCB_BACK_PIXMAP_NONE,
@@ -362,7 +365,11 @@ bool window_create(struct window *window)
 	return window->render_ctx;
 }
 
-bool xcb_dispatch(void)
+/**
+ * Обрабатывает сообщения сервера.
+ * \param wait ожидать первое сообщение, иначе только уже поступившие.
+ */
+static bool dispatch(bool wait)
 {
 	bool flush = false;
 	// Диспетчеру приходится совместить обработку асинхронных сообщений сервера
@@ -378,15 +385,21 @@ bool xcb_dispatch(void)
 	// потому используем XCB_RESIZE_REQUEST.
 	xcb_expose_event_t         *expose = NULL;
 	xcb_resize_request_event_t *resize = NULL;
-	xcb_generic_event_t *e = xcb_wait_for_event(connection);
+	xcb_generic_event_t *e = wait ? xcb_wait_for_event(connection)
+	                              : xcb_poll_for_event(connection);
 	while (e) {
 		switch (e->response_type & 0x7f) {
 		// xcb_create_window_checked(). Рендер ещё не инициализирован.
 		case XCB_CREATE_NOTIFY:
 			break;
-		// xcb_map_window(). Для окна XCB_WINDOW_CLASS_INPUT_OUTPUT
-		// генерируется XCB_EXPOSE, когда окно становится видимым.
+		// xcb_map_window() и восстановление свёрнутого окна. Для окна
+		// XCB_WINDOW_CLASS_INPUT_OUTPUT генерируется XCB_EXPOSE, когда окно
+		// становится видимым, а XCB_VISIBILITY_NOTIFY может не прийти.
 		case XCB_MAP_NOTIFY:
+			window_visibility(window_get_ptr(((xcb_map_notify_event_t*)e)->window), true);
+			break;
+		case XCB_UNMAP_NOTIFY:
+			window_visibility(window_get_ptr(((xcb_unmap_notify_event_t*)e)->window), false);
 			break;
 		// TODO В Gnome не актуально: приходит однократно перед XCB_EXPOSE.
 		// В Mate и XFCE приходит только XCB_VISIBILITY_UNOBSCURED.
@@ -394,7 +407,7 @@ bool xcb_dispatch(void)
 			flush = true;
 			xcb_visibility_notify_event_t *ev = (xcb_visibility_notify_event_t*)e;
 			struct window *window = window_get_ptr(ev->window);
-			window->visible = ev->state != XCB_VISIBILITY_FULLY_OBSCURED;
+			window_visibility(window, ev->state != XCB_VISIBILITY_FULLY_OBSCURED);
 			break;
 		case XCB_CLIENT_MESSAGE:
 			if (atom[wm_delete_window].id == ((xcb_client_message_event_t*)e)->data.data32[0])
@@ -458,11 +471,26 @@ bool xcb_dispatch(void)
 		free(resize);
 		flush = true;
 	}
-	if (flush)
+	if (flush || !wait)
 		xcb_flush(connection);
 	return !xcb_connection_has_error(connection);
 }
 
+bool xcb_dispatch(void)
+{
+	return dispatch(true);
+}
+
+bool xcb_dispatch_pending(void)
+{
+	return dispatch(false);
+}
+
+int xcb_fd(void)
+{
+	return xcb_get_file_descriptor(connection);
+}
+
 void window_destroy(struct window *window)
 {
 	if (window->render->destroy && window->render_ctx)
@@ -0,0 +1,841 @@
+/**\file
+ * \brief	Интерпретатор процессора Z80 для проигрывателей музыки ZX-Spectrum.
+ *
+ *  Основные команды выбираются переходом по таблице адресов меток, и каждый
+ *  обработчик сам переходит к следующей команде. Команды с префиксами CB и ED
+ *  декодируются по полям кода. Префиксы DD и FD заменяют HL на IX и IY.
+ *  Флаги вычисляются вместе с недокументированными разрядами 3 и 5, кроме
+ *  блочных команд ввода-вывода, у которых точен лишь флаг Z.
+ */
+
+#include <stddef.h>
+
+#include "z80.h"
+
+/// Номера регистров в z80.r, совпадающие с полями кодов команд.
+enum { rB = 0, rC, rD, rE, rH, rL, rF, rA, rIXh, rIXl, rIYh, rIYl };
+
+/// Разряды регистра флагов.
+enum {
+	fC	= 0x01,
+	fN	= 0x02,
+	fP	= 0x04,
+	fX	= 0x08,
+	fH	= 0x10,
+	fY	= 0x20,
+	fZ	= 0x40,
+	fS	= 0x80,
+};
+
+/** Тактов основных команд (без префиксов) при невыполненном условии. */
+static const uint8_t cycles[256] = {
+	 4, 10,  7,  6,  4,  4,  7,  4,  4, 11,  7,  6,  4,  4,  7,  4,	// 00
+	 8, 10,  7,  6,  4,  4,  7,  4, 12, 11,  7,  6,  4,  4,  7,  4,	// 10
+	 7, 10, 16,  6,  4,  4,  7,  4,  7, 11, 16,  6,  4,  4,  7,  4,	// 20
+	 7, 10, 13,  6, 11, 11, 10,  4,  7, 11, 13,  6,  4,  4,  7,  4,	// 30
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,	// 40
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,	// 50
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,	// 60
+	 7,  7,  7,  7,  7,  7,  4,  7,  4,  4,  4,  4,  4,  4,  7,  4,	// 70
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,	// 80
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,	// 90
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,	// A0
+	 4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,	// B0
+	 5, 10, 10, 10, 10, 11,  7, 11,  5, 10, 10,  0, 10, 17,  7, 11,	// C0
+	 5, 10, 10, 11, 10, 11,  7, 11,  5,  4, 10, 11, 10,  4,  7, 11,	// D0
+	 5, 10, 10, 19, 10, 11,  7, 11,  5,  4, 10,  4, 10,  0,  7, 11,	// E0
+	 5, 10, 10,  4, 10, 11,  7, 11,  5,  6, 10,  4, 10,  4,  7, 11,	// F0
+};
+
+/// Старший байт HL, IX, IY в z80.r по префиксу (0, DD, FD).
+static const uint8_t hl_index[3] = { rH, rIXh, rIYh };
+
+static inline uint8_t sz53(uint8_t v)
+{
+	return (v & (fS | fY | fX)) | (v ? 0 : fZ);
+}
+
+static inline uint8_t sz53p(uint8_t v)
+{
+	return sz53(v) | (__builtin_parity(v) ? 0 : fP);
+}
+
+static inline uint8_t rd(const struct z80 *z, uint16_t addr)
+{
+	return z->mem[addr];
+}
+
+static inline void wr(struct z80 *z, uint16_t addr, uint8_t v)
+{
+	z->mem[addr] = v;
+}
+
+static inline uint16_t rd16(const struct z80 *z, uint16_t addr)
+{
+	return rd(z, addr) | rd(z, addr + 1) << 8;
+}
+
+static inline void wr16(struct z80 *z, uint16_t addr, uint16_t v)
+{
+	wr(z, addr, v);
+	wr(z, addr + 1, v >> 8);
+}
+
+static inline uint8_t imm8(struct z80 *z)
+{
+	return rd(z, z->pc++);
+}
+
+static inline uint16_t imm16(struct z80 *z)
+{
+	const uint16_t v = rd16(z, z->pc);
+	z->pc += 2;
+	return v;
+}
+
+/** Выборка кода команды или префикса (цикл M1) наращивает регистр R. */
+static inline uint8_t fetch(struct z80 *z)
+{
+	z->refresh = (z->refresh & 0x80) | ((z->refresh + 1) & 0x7F);
+	return imm8(z);
+}
+
+static inline void push(struct z80 *z, uint16_t v)
+{
+	z->sp -= 2;
+	wr16(z, z->sp, v);
+}
+
+static inline uint16_t pop(struct z80 *z)
+{
+	const uint16_t v = rd16(z, z->sp);
+	z->sp += 2;
+	return v;
+}
+
+static inline uint8_t port_in(struct z80 *z, uint16_t port)
+{
+	return z->bus.in ? z->bus.in(z->bus.ctx, port) : 0xFF;
+}
+
+static inline void port_out(struct z80 *z, uint16_t port, uint8_t v)
+{
+	if (z->bus.out)
+		z->bus.out(z->bus.ctx, port, v);
+}
+
+/** Пара регистров со старшим байтом в z80.r[n]. */
+static inline uint16_t get_pair(const struct z80 *z, unsigned n)
+{
+	return z->r[n] << 8 | z->r[n + 1];
+}
+
+static inline void set_pair(struct z80 *z, unsigned n, uint16_t v)
+{
+	z->r[n]     = v >> 8;
+	z->r[n + 1] = v;
+}
+
+static inline uint16_t get_af(const struct z80 *z)
+{
+	return z->r[rA] << 8 | z->r[rF];
+}
+
+static inline void set_af(struct z80 *z, uint16_t v)
+{
+	z->r[rA] = v >> 8;
+	z->r[rF] = v;
+}
+
+/** Пара из поля команды: BC, DE, HL (IX, IY), SP. */
+static inline uint16_t rr_get(const struct z80 *z, unsigned n, unsigned p)
+{
+	return n == 3 ? z->sp : get_pair(z, n == 2 ? hl_index[p] : 2 * n);
+}
+
+static inline void rr_set(struct z80 *z, unsigned n, unsigned p, uint16_t v)
+{
+	if (n == 3)
+		z->sp = v;
+	else
+		set_pair(z, n == 2 ? hl_index[p] : 2 * n, v);
+}
+
+/** Пара из поля команд PUSH и POP: BC, DE, HL (IX, IY), AF. */
+static inline uint16_t qq_get(const struct z80 *z, unsigned n, unsigned p)
+{
+	return n == 3 ? get_af(z) : rr_get(z, n, p);
+}
+
+static inline void qq_set(struct z80 *z, unsigned n, unsigned p, uint16_t v)
+{
+	if (n == 3)
+		set_af(z, v);
+	else
+		rr_set(z, n, p, v);
+}
+
+/** Регистр из поля команды (кроме 6); с префиксом H и L заменяются половинами IX, IY. */
+static inline uint8_t *reg8(struct z80 *z, unsigned n, unsigned p)
+{
+	static const uint8_t offset[3] = { 0, rIXh - rH, rIYh - rH };
+	return &z->r[n == rH || n == rL ? n + offset[p] : n];
+}
+
+/** Адрес операнда (HL), с префиксом — (IX+d), (IY+d). */
+static inline uint16_t hl_addr(struct z80 *z, unsigned p)
+{
+	if (!p)
+		return get_pair(z, rH);
+	const int8_t d = imm8(z);
+	z->tstate += 8;
+	return get_pair(z, hl_index[p]) + d;
+}
+
+/** Условие перехода: NZ, Z, NC, C, PO, PE, P, M. */
+static inline bool cond(const struct z80 *z, unsigned cc)
+{
+	static const uint8_t mask[4] = { fZ, fC, fP, fS };
+	return !(z->r[rF] & mask[cc >> 1]) == !(cc & 1);
+}
+
+/** Арифметико-логическая операция над A: ADD, ADC, SUB, SBC, AND, XOR, OR, CP. */
+static void alu(struct z80 *z, unsigned op, uint8_t v)
+{
+	const uint8_t a = z->r[rA];
+	const unsigned c = z->r[rF] & fC;
+	unsigned res;
+	switch (op) {
+	case 0: case 1:
+		res = a + v + (op == 1 ? c : 0);
+		z->r[rF] = sz53(res) | ((a ^ v ^ res) & fH)
+		         | ((~(a ^ v) & (a ^ res) & 0x80) >> 5) | res >> 8;
+		break;
+	case 2: case 3: case 7:
+		res = a - v - (op == 3 ? c : 0);
+		z->r[rF] = fN | ((a ^ v ^ res) & fH)
+		         | (((a ^ v) & (a ^ res) & 0x80) >> 5) | ((res >> 8) & fC);
+		if (op == 7) {
+			// CP копирует разряды 3 и 5 из операнда.
+			z->r[rF] |= (sz53(res) & ~(fY | fX)) | (v & (fY | fX));
+			return;
+		}
+		z->r[rF] |= sz53(res);
+		break;
+	case 4:
+		res = a & v;
+		z->r[rF] = sz53p(res) | fH;
+		break;
+	case 5:
+		res = a ^ v;
+		z->r[rF] = sz53p(res);
+		break;
+	default:
+		res = a | v;
+		z->r[rF] = sz53p(res);
+		break;
+	}
+	z->r[rA] = res;
+}
+
+static uint8_t inc8(struct z80 *z, uint8_t v)
+{
+	const uint8_t res = v + 1;
+	z->r[rF] = (z->r[rF] & fC) | sz53(res) | (res & 0x0F ? 0 : fH) | (res == 0x80 ? fP : 0);
+	return res;
+}
+
+static uint8_t dec8(struct z80 *z, uint8_t v)
+{
+	const uint8_t res = v - 1;
+	z->r[rF] = (z->r[rF] & fC) | fN | sz53(res) | (v & 0x0F ? 0 : fH) | (v == 0x80 ? fP : 0);
+	return res;
+}
+
+/** Сдвиг с префиксом CB: RLC, RRC, RL, RR, SLA, SRA, SLL, SRL. */
+static uint8_t rot(struct z80 *z, unsigned op, uint8_t v)
+{
+	const unsigned carry = z->r[rF] & fC;
+	unsigned c;
+	uint8_t res;
+	switch (op) {
+	case 0: c = v >> 7;	res = v << 1 | c;           	break;
+	case 1: c = v & 1; 	res = v >> 1 | c << 7;      	break;
+	case 2: c = v >> 7;	res = v << 1 | carry;       	break;
+	case 3: c = v & 1; 	res = v >> 1 | carry << 7;  	break;
+	case 4: c = v >> 7;	res = v << 1;               	break;
+	case 5: c = v & 1; 	res = v >> 1 | (v & 0x80);  	break;
+	case 6: c = v >> 7;	res = v << 1 | 1;           	break;
+	default: c = v & 1;	res = v >> 1;               	break;
+	}
+	z->r[rF] = sz53p(res) | c;
+	return res;
+}
+
+static uint16_t add16(struct z80 *z, uint16_t a, uint16_t b)
+{
+	const unsigned res = a + b;
+	z->r[rF] = (z->r[rF] & (fS | fZ | fP)) | ((res >> 8) & (fY | fX))
+	         | (((a ^ b ^ res) >> 8) & fH) | res >> 16;
+	return res;
+}
+
+/** ADC HL,rr или SBC HL,rr. */
+static void adc16(struct z80 *z, bool sub, uint16_t b)
+{
+	const uint16_t a = get_pair(z, rH);
+	const unsigned c = z->r[rF] & fC;
+	const unsigned res = sub ? a - b - c : a + b + c;
+	const unsigned v = sub ? (a ^ b) & (a ^ res) : ~(a ^ b) & (a ^ res);
+	z->r[rF] = (sub ? fN : 0) | ((res >> 8) & (fS | fY | fX)) | (res & 0xFFFF ? 0 : fZ)
+	         | (((a ^ b ^ res) >> 8) & fH) | ((v >> 13) & fP) | ((res >> 16) & fC);
+	set_pair(z, rH, res);
+}
+
+/** Команды с префиксом CB, с префиксом DD или FD — над (IX+d), (IY+d). */
+static void cb(struct z80 *z, unsigned p)
+{
+	uint16_t addr;
+	uint8_t op;
+	if (p) {
+		// Смещение предшествует коду операции, который не выбирается циклом M1.
+		addr = get_pair(z, hl_index[p]) + (int8_t)imm8(z);
+		op = imm8(z);
+		z->tstate += 19;
+	} else {
+		op = fetch(z);
+		addr = get_pair(z, rH);
+		z->tstate += (op & 7) == 6 ? 15 : 8;
+	}
+	const unsigned y = (op >> 3) & 7, n = op & 7;
+	const bool mem = p || n == 6;
+	uint8_t v = mem ? rd(z, addr) : z->r[n];
+	switch (op >> 6) {
+	case 0:
+		v = rot(z, y, v);
+		break;
+	case 1:
+		z->r[rF] = (z->r[rF] & fC) | fH | (sz53p(v & 1 << y) & ~(fY | fX))
+		         | ((mem ? addr >> 8 : v) & (fY | fX));
+		if (mem)
+			z->tstate -= 3;
+		return;
+	case 2:
+		v &= ~(1 << y);
+		break;
+	default:
+		v |= 1 << y;
+		break;
+	}
+	if (mem)
+		wr(z, addr, v);
+	// С префиксом результат также копируется в регистр (недокументированно).
+	if (n != 6)
+		z->r[n] = v;
+}
+
+/** Блочные команды LDI, CPI, INI, OUTI и их разновидности. */
+static void ed_block(struct z80 *z, uint8_t op)
+{
+	const int step = op & 8 ? -1 : 1;
+	uint16_t hl = get_pair(z, rH), bc = get_pair(z, rB);
+	const uint8_t a = z->r[rA];
+	bool again;
+	z->tstate += 16;
+	switch (op & 3) {
+	case 0: {
+		const uint8_t v = rd(z, hl);
+		const uint16_t de = get_pair(z, rD);
+		wr(z, de, v);
+		set_pair(z, rD, de + step);
+		--bc;
+		const uint8_t n = v + a;
+		z->r[rF] = (z->r[rF] & (fS | fZ | fC)) | (bc ? fP : 0) | (n & fX) | ((n << 4) & fY);
+		again = bc;
+		break;
+	}
+	case 1: {
+		const uint8_t v = rd(z, hl);
+		const uint8_t res = a - v;
+		const uint8_t h = (a ^ v ^ res) & fH;
+		const uint8_t n = res - (h ? 1 : 0);
+		--bc;
+		z->r[rF] = (z->r[rF] & fC) | fN | (sz53(res) & ~(fY | fX)) | h
+		         | (bc ? fP : 0) | (n & fX) | ((n << 4) & fY);
+		again = bc && res;
+		break;
+	}
+	case 2:
+		wr(z, hl, port_in(z, bc));
+		bc -= 0x100;
+		z->r[rF] = sz53(bc >> 8) | fN;
+		again = bc >> 8;
+		break;
+	default:
+		// Порт выбирается уже уменьшенным B.
+		bc -= 0x100;
+		port_out(z, bc, rd(z, hl));
+		z->r[rF] = sz53(bc >> 8) | fN;
+		again = bc >> 8;
+		break;
+	}
+	set_pair(z, rH, hl + step);
+	set_pair(z, rB, bc);
+	if (op & 0x10 && again) {
+		z->pc -= 2;
+		z->tstate += 5;
+	}
+}
+
+/** Команды с префиксом ED. Префиксы DD и FD на них не влияют. */
+static void ed(struct z80 *z, uint8_t op)
+{
+	const unsigned y = (op >> 3) & 7;
+	if ((op & 0xE4) == 0xA0) {
+		ed_block(z, op);
+		return;
+	}
+	if (op < 0x40 || op >= 0x80) {
+		z->tstate += 8;
+		return;
+	}
+	switch (op & 7) {
+	case 0: {
+		z->tstate += 12;
+		const uint8_t v = port_in(z, get_pair(z, rB));
+		// IN F,(C) лишь устанавливает флаги.
+		if (y != rF)
+			z->r[y] = v;
+		z->r[rF] = (z->r[rF] & fC) | sz53p(v);
+		break;
+	}
+	case 1:
+		z->tstate += 12;
+		port_out(z, get_pair(z, rB), y == rF ? 0 : z->r[y]);
+		break;
+	case 2:
+		z->tstate += 15;
+		adc16(z, !(op & 8), rr_get(z, y >> 1, 0));
+		break;
+	case 3: {
+		z->tstate += 20;
+		const uint16_t addr = imm16(z);
+		if (op & 8)
+			rr_set(z, y >> 1, 0, rd16(z, addr));
+		else
+			wr16(z, addr, rr_get(z, y >> 1, 0));
+		break;
+	}
+	case 4: {
+		z->tstate += 8;
+		const uint8_t v = z->r[rA];
+		z->r[rA] = 0;
+		alu(z, 2, v);
+		break;
+	}
+	case 5:
+		z->tstate += 14;
+		z->pc = pop(z);
+		z->iff1 = z->iff2;
+		break;
+	case 6: {
+		static const uint8_t mode[4] = { 0, 0, 1, 2 };
+		z->tstate += 8;
+		z->im = mode[y & 3];
+		break;
+	}
+	default: {
+		const uint8_t a = z->r[rA];
+		const uint16_t hl = get_pair(z, rH);
+		z->tstate += 9;
+		switch (y) {
+		case 0:
+			z->i = a;
+			break;
+		case 1:
+			z->refresh = a;
+			break;
+		case 2: case 3:
+			z->r[rA] = y == 2 ? z->i : z->refresh;
+			z->r[rF] = (z->r[rF] & fC) | sz53(z->r[rA]) | (z->iff2 ? fP : 0);
+			break;
+		case 4: case 5: {
+			const uint8_t v = rd(z, hl);
+			z->tstate += 9;
+			if (y == 4) {
+				wr(z, hl, a << 4 | v >> 4);
+				z->r[rA] = (a & 0xF0) | (v & 0x0F);
+			} else {
+				wr(z, hl, v << 4 | (a & 0x0F));
+				z->r[rA] = (a & 0xF0) | v >> 4;
+			}
+			z->r[rF] = (z->r[rF] & fC) | sz53p(z->r[rA]);
+			break;
+		}
+		default:
+			z->tstate -= 1;
+			break;
+		}
+		break;
+	}
+	}
+}
+
+void z80_reset(struct z80 *z, uint8_t *mem, const struct z80_bus *bus)
+{
+	*z = (struct z80) {
+		.mem = mem,
+		.bus = *bus,
+	};
+}
+
+void z80_run(struct z80 *z, unsigned end)
+{
+	static const void *const ops[256] = {
+		[0x00] = &&nop,     	[0x08] = &&ex_af,   	[0x10] = &&djnz,    	[0x18] = &&jr,
+		[0x20] = &&jr_cc,   	[0x28] = &&jr_cc,   	[0x30] = &&jr_cc,   	[0x38] = &&jr_cc,
+		[0x01] = &&ld_rr_nn,	[0x11] = &&ld_rr_nn,	[0x21] = &&ld_rr_nn,	[0x31] = &&ld_rr_nn,
+		[0x09] = &&add_hl,  	[0x19] = &&add_hl,  	[0x29] = &&add_hl,  	[0x39] = &&add_hl,
+		[0x02] = &&ld_rp_a, 	[0x12] = &&ld_rp_a, 	[0x22] = &&ld_nn_hl,	[0x32] = &&ld_nn_a,
+		[0x0A] = &&ld_a_rp, 	[0x1A] = &&ld_a_rp, 	[0x2A] = &&ld_hl_nn,	[0x3A] = &&ld_a_nn,
+		[0x03] = &&inc_rr,  	[0x13] = &&inc_rr,  	[0x23] = &&inc_rr,  	[0x33] = &&inc_rr,
+		[0x0B] = &&dec_rr,  	[0x1B] = &&dec_rr,  	[0x2B] = &&dec_rr,  	[0x3B] = &&dec_rr,
+		[0x04] = &&inc_r,   	[0x0C] = &&inc_r,   	[0x14] = &&inc_r,   	[0x1C] = &&inc_r,
+		[0x24] = &&inc_r,   	[0x2C] = &&inc_r,   	[0x34] = &&inc_r,   	[0x3C] = &&inc_r,
+		[0x05] = &&dec_r,   	[0x0D] = &&dec_r,   	[0x15] = &&dec_r,   	[0x1D] = &&dec_r,
+		[0x25] = &&dec_r,   	[0x2D] = &&dec_r,   	[0x35] = &&dec_r,   	[0x3D] = &&dec_r,
+		[0x06] = &&ld_r_n,  	[0x0E] = &&ld_r_n,  	[0x16] = &&ld_r_n,  	[0x1E] = &&ld_r_n,
+		[0x26] = &&ld_r_n,  	[0x2E] = &&ld_r_n,  	[0x36] = &&ld_r_n,  	[0x3E] = &&ld_r_n,
+		[0x07] = &&rlca,    	[0x0F] = &&rrca,    	[0x17] = &&rla,     	[0x1F] = &&rra,
+		[0x27] = &&daa,     	[0x2F] = &&cpl,     	[0x37] = &&scf,     	[0x3F] = &&ccf,
+		[0x40 ... 0x75] = &&ld_r_r,
+		[0x76] = &&halt,
+		[0x77 ... 0x7F] = &&ld_r_r,
+		[0x80 ... 0xBF] = &&alu_r,
+		[0xC0] = &&ret_cc,  	[0xC8] = &&ret_cc,  	[0xD0] = &&ret_cc,  	[0xD8] = &&ret_cc,
+		[0xE0] = &&ret_cc,  	[0xE8] = &&ret_cc,  	[0xF0] = &&ret_cc,  	[0xF8] = &&ret_cc,
+		[0xC2] = &&jp_cc,   	[0xCA] = &&jp_cc,   	[0xD2] = &&jp_cc,   	[0xDA] = &&jp_cc,
+		[0xE2] = &&jp_cc,   	[0xEA] = &&jp_cc,   	[0xF2] = &&jp_cc,   	[0xFA] = &&jp_cc,
+		[0xC4] = &&call_cc, 	[0xCC] = &&call_cc, 	[0xD4] = &&call_cc, 	[0xDC] = &&call_cc,
+		[0xE4] = &&call_cc, 	[0xEC] = &&call_cc, 	[0xF4] = &&call_cc, 	[0xFC] = &&call_cc,
+		[0xC6] = &&alu_n,   	[0xCE] = &&alu_n,   	[0xD6] = &&alu_n,   	[0xDE] = &&alu_n,
+		[0xE6] = &&alu_n,   	[0xEE] = &&alu_n,   	[0xF6] = &&alu_n,   	[0xFE] = &&alu_n,
+		[0xC7] = &&rst,     	[0xCF] = &&rst,     	[0xD7] = &&rst,     	[0xDF] = &&rst,
+		[0xE7] = &&rst,     	[0xEF] = &&rst,     	[0xF7] = &&rst,     	[0xFF] = &&rst,
+		[0xC1] = &&pop,     	[0xD1] = &&pop,     	[0xE1] = &&pop,     	[0xF1] = &&pop,
+		[0xC5] = &&push,    	[0xD5] = &&push,    	[0xE5] = &&push,    	[0xF5] = &&push,
+		[0xC3] = &&jp,      	[0xC9] = &&ret,     	[0xCD] = &&call,    	[0xE9] = &&jp_hl,
+		[0xD3] = &&out_n,   	[0xDB] = &&in_n,    	[0xD9] = &&exx,     	[0xE3] = &&ex_sp_hl,
+		[0xEB] = &&ex_de_hl,	[0xF9] = &&ld_sp_hl,	[0xF3] = &&di,      	[0xFB] = &&ei,
+		[0xCB] = &&cb,      	[0xED] = &&ed,      	[0xDD] = &&ix,      	[0xFD] = &&iy,
+	};
+	// Префикс DD или FD (1, 2) выполняемой команды.
+	unsigned p;
+	uint8_t op;
+
+	// Каждый обработчик сам выбирает следующую команду: переход по таблице
+	// из многих мест лучше предсказывается, чем из общего цикла.
+#define DISPATCH() do {                      	\
+		if (z->tstate >= end || z->halted)	\
+			goto leave;               	\
+		p = 0;                            	\
+		op = fetch(z);                    	\
+		z->tstate += cycles[op];          	\
+		goto *ops[op];                    	\
+	} while (0)
+
+	DISPATCH();
+
+ix:
+	p = 1;
+	goto prefixed;
+iy:
+	p = 2;
+prefixed:
+	op = fetch(z);
+	z->tstate += cycles[op];
+	goto *ops[op];
+
+nop:
+	DISPATCH();
+ex_af: {
+	const uint16_t af = get_af(z);
+	set_af(z, z->alt[3]);
+	z->alt[3] = af;
+	DISPATCH();
+}
+exx:
+	for (unsigned n = 0; n < 3; ++n) {
+		const uint16_t v = get_pair(z, 2 * n);
+		set_pair(z, 2 * n, z->alt[n]);
+		z->alt[n] = v;
+	}
+	DISPATCH();
+djnz: {
+	const int8_t d = imm8(z);
+	if (--z->r[rB]) {
+		z->pc += d;
+		z->tstate += 5;
+	}
+	DISPATCH();
+}
+jr: {
+	const int8_t d = imm8(z);
+	z->pc += d;
+	DISPATCH();
+}
+jr_cc: {
+	const int8_t d = imm8(z);
+	if (cond(z, (op >> 3) & 3)) {
+		z->pc += d;
+		z->tstate += 5;
+	}
+	DISPATCH();
+}
+ld_rr_nn:
+	rr_set(z, op >> 4, p, imm16(z));
+	DISPATCH();
+add_hl:
+	set_pair(z, hl_index[p], add16(z, get_pair(z, hl_index[p]), rr_get(z, op >> 4, p)));
+	DISPATCH();
+ld_rp_a:
+	wr(z, get_pair(z, (op >> 3) & 2), z->r[rA]);
+	DISPATCH();
+ld_a_rp:
+	z->r[rA] = rd(z, get_pair(z, (op >> 3) & 2));
+	DISPATCH();
+ld_nn_hl:
+	wr16(z, imm16(z), get_pair(z, hl_index[p]));
+	DISPATCH();
+ld_hl_nn:
+	set_pair(z, hl_index[p], rd16(z, imm16(z)));
+	DISPATCH();
+ld_nn_a:
+	wr(z, imm16(z), z->r[rA]);
+	DISPATCH();
+ld_a_nn:
+	z->r[rA] = rd(z, imm16(z));
+	DISPATCH();
+inc_rr:
+	rr_set(z, op >> 4, p, rr_get(z, op >> 4, p) + 1);
+	DISPATCH();
+dec_rr:
+	rr_set(z, op >> 4, p, rr_get(z, op >> 4, p) - 1);
+	DISPATCH();
+inc_r:
+	if (op >> 3 == 6) {
+		const uint16_t addr = hl_addr(z, p);
+		wr(z, addr, inc8(z, rd(z, addr)));
+	} else {
+		uint8_t *r = reg8(z, op >> 3, p);
+		*r = inc8(z, *r);
+	}
+	DISPATCH();
+dec_r:
+	if (op >> 3 == 6) {
+		const uint16_t addr = hl_addr(z, p);
+		wr(z, addr, dec8(z, rd(z, addr)));
+	} else {
+		uint8_t *r = reg8(z, op >> 3, p);
+		*r = dec8(z, *r);
+	}
+	DISPATCH();
+ld_r_n:
+	if (op >> 3 == 6) {
+		const uint16_t addr = hl_addr(z, p);
+		// LD (IX+d),n короче на 3 такта: смещение и операнд выбираются вместе.
+		if (p)
+			z->tstate -= 3;
+		wr(z, addr, imm8(z));
+	} else {
+		*reg8(z, op >> 3, p) = imm8(z);
+	}
+	DISPATCH();
+rlca: {
+	const uint8_t a = z->r[rA] << 1 | z->r[rA] >> 7;
+	z->r[rF] = (z->r[rF] & (fS | fZ | fP)) | (a & (fY | fX | fC));
+	z->r[rA] = a;
+	DISPATCH();
+}
+rrca: {
+	const uint8_t c = z->r[rA] & fC;
+	const uint8_t a = z->r[rA] >> 1 | c << 7;
+	z->r[rF] = (z->r[rF] & (fS | fZ | fP)) | (a & (fY | fX)) | c;
+	z->r[rA] = a;
+	DISPATCH();
+}
+rla: {
+	const uint8_t c = z->r[rA] >> 7;
+	const uint8_t a = z->r[rA] << 1 | (z->r[rF] & fC);
+	z->r[rF] = (z->r[rF] & (fS | fZ | fP)) | (a & (fY | fX)) | c;
+	z->r[rA] = a;
+	DISPATCH();
+}
+rra: {
+	const uint8_t c = z->r[rA] & fC;
+	const uint8_t a = z->r[rA] >> 1 | (z->r[rF] & fC) << 7;
+	z->r[rF] = (z->r[rF] & (fS | fZ | fP)) | (a & (fY | fX)) | c;
+	z->r[rA] = a;
+	DISPATCH();
+}
+daa: {
+	const uint8_t a = z->r[rA], f = z->r[rF];
+	uint8_t add = 0, c = f & fC, h, res;
+	if (f & fH || (a & 0x0F) > 9)
+		add = 0x06;
+	if (c || a > 0x99) {
+		add |= 0x60;
+		c = fC;
+	}
+	if (f & fN) {
+		h = f & fH && (a & 0x0F) < 6 ? fH : 0;
+		res = a - add;
+	} else {
+		h = (a & 0x0F) > 9 ? fH : 0;
+		res = a + add;
+	}
+	z->r[rF] = sz53p(res) | (f & fN) | h | c;
+	z->r[rA] = res;
+	DISPATCH();
+}
+cpl:
+	z->r[rA] = ~z->r[rA];
+	z->r[rF] = (z->r[rF] & (fS | fZ | fP | fC)) | fH | fN | (z->r[rA] & (fY | fX));
+	DISPATCH();
+scf:
+	z->r[rF] = (z->r[rF] & (fS | fZ | fP)) | (z->r[rA] & (fY | fX)) | fC;
+	DISPATCH();
+ccf:
+	z->r[rF] = (z->r[rF] & (fS | fZ | fP)) | (z->r[rF] & fC ? fH : fC) | (z->r[rA] & (fY | fX));
+	DISPATCH();
+ld_r_r: {
+	const unsigned dst = (op >> 3) & 7, src = op & 7;
+	// С операндом (IX+d) второй операнд — настоящие H и L.
+	if (src == 6)
+		z->r[dst] = rd(z, hl_addr(z, p));
+	else if (dst == 6)
+		wr(z, hl_addr(z, p), z->r[src]);
+	else
+		*reg8(z, dst, p) = *reg8(z, src, p);
+	DISPATCH();
+}
+halt:
+	// Ожидание прерывания: PC уже указывает на следующую команду.
+	z->halted = true;
+	DISPATCH();
+alu_r:
+	alu(z, (op >> 3) & 7, (op & 7) == 6 ? rd(z, hl_addr(z, p)) : *reg8(z, op & 7, p));
+	DISPATCH();
+alu_n:
+	alu(z, (op >> 3) & 7, imm8(z));
+	DISPATCH();
+ret_cc:
+	if (cond(z, (op >> 3) & 7)) {
+		z->pc = pop(z);
+		z->tstate += 6;
+	}
+	DISPATCH();
+jp_cc: {
+	const uint16_t addr = imm16(z);
+	if (cond(z, (op >> 3) & 7))
+		z->pc = addr;
+	DISPATCH();
+}
+call_cc: {
+	const uint16_t addr = imm16(z);
+	if (cond(z, (op >> 3) & 7)) {
+		push(z, z->pc);
+		z->pc = addr;
+		z->tstate += 7;
+	}
+	DISPATCH();
+}
+rst:
+	push(z, z->pc);
+	z->pc = op & 0x38;
+	DISPATCH();
+pop:
+	qq_set(z, (op >> 4) & 3, p, pop(z));
+	DISPATCH();
+push:
+	push(z, qq_get(z, (op >> 4) & 3, p));
+	DISPATCH();
+jp:
+	z->pc = imm16(z);
+	DISPATCH();
+ret:
+	z->pc = pop(z);
+	DISPATCH();
+call: {
+	const uint16_t addr = imm16(z);
+	push(z, z->pc);
+	z->pc = addr;
+	DISPATCH();
+}
+jp_hl:
+	z->pc = get_pair(z, hl_index[p]);
+	DISPATCH();
+out_n:
+	port_out(z, z->r[rA] << 8 | imm8(z), z->r[rA]);
+	DISPATCH();
+in_n:
+	z->r[rA] = port_in(z, z->r[rA] << 8 | imm8(z));
+	DISPATCH();
+ex_sp_hl: {
+	const uint16_t v = rd16(z, z->sp);
+	wr16(z, z->sp, get_pair(z, hl_index[p]));
+	set_pair(z, hl_index[p], v);
+	DISPATCH();
+}
+ex_de_hl: {
+	const uint16_t de = get_pair(z, rD);
+	set_pair(z, rD, get_pair(z, rH));
+	set_pair(z, rH, de);
+	DISPATCH();
+}
+ld_sp_hl:
+	z->sp = get_pair(z, hl_index[p]);
+	DISPATCH();
+di:
+	z->iff1 = z->iff2 = false;
+	DISPATCH();
+ei:
+	z->iff1 = z->iff2 = true;
+	DISPATCH();
+cb:
+	cb(z, p);
+	DISPATCH();
+ed:
+	ed(z, fetch(z));
+	DISPATCH();
+#undef DISPATCH
+
+leave:
+	if (z->halted && z->tstate < end) {
+		// HALT выполняет NOP до прерывания — пропускаем их разом.
+		const unsigned nops = (end - z->tstate + 3) / 4;
+		z->refresh = (z->refresh & 0x80) | ((z->refresh + nops) & 0x7F);
+		z->tstate += 4 * nops;
+		z->idle += 4 * nops;
+	}
+}
+
+bool z80_interrupt(struct z80 *z)
+{
+	if (!z->iff1)
+		return false;
+	z->halted = false;
+	z->iff1 = z->iff2 = false;
+	z->refresh = (z->refresh & 0x80) | ((z->refresh + 1) & 0x7F);
+	push(z, z->pc);
+	if (z->im == 2) {
+		// На шине данных ZX-Spectrum при прерывании 0xFF.
+		z->pc = rd16(z, z->i << 8 | 0xFF);
+		z->tstate += 19;
+	} else {
+		// IM 0 с 0xFF на шине выполняет RST 38h, как и IM 1.
+		z->pc = 0x38;
+		z->tstate += 13;
+	}
+	return true;
+}
@@ -0,0 +1,61 @@
+/**\file
+ * \brief	Интерпретатор процессора Z80 для проигрывателей музыки ZX-Spectrum.
+ *
+ *  Выполняет исходные программы проигрывателей, написанные для ZX-Spectrum:
+ *  команды выбираются по таблице адресов меток (computed goto), такты
+ *  считаются по каждой команде, а ввод-вывод передаётся обработчикам.
+ *  Во время обмена z80.tstate — такт кадра, на котором завершается команда.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum {
+	/// Тактов Z80 в кадре ZX-Spectrum 128 (3546900 Гц / 50).
+	z80_frame_tstates	= 70908,
+};
+
+/** Обработчики ввода-вывода. */
+struct z80_bus {
+	void   	*ctx;
+	uint8_t	(*in)(void *ctx, uint16_t port);
+	void   	(*out)(void *ctx, uint16_t port, uint8_t value);
+};
+
+/** Состояние процессора. */
+struct z80 {
+	/** B, C, D, E, H, L, F, A, IXh, IXl, IYh, IYl — в порядке полей команд */
+	uint8_t       	r[12];
+	/** Альтернативные BC, DE, HL, AF */
+	uint16_t      	alt[4];
+	uint16_t      	sp;
+	uint16_t      	pc;
+	uint8_t       	i;
+	uint8_t       	refresh;
+	/** Режим прерываний 0–2 */
+	uint8_t       	im;
+	bool          	iff1;
+	bool          	iff2;
+	bool          	halted;
+	/** Такт текущего кадра */
+	unsigned      	tstate;
+	/** Тактов, пропущенных в ожидании прерывания (HALT), после сброса */
+	uint64_t      	idle;
+	/** Память 64 КБ, вся доступна для записи */
+	uint8_t       	*mem;
+	struct z80_bus	bus;
+};
+
+/** Сбрасывает процессор: PC = 0, прерывания запрещены. */
+void z80_reset(struct z80 *z, uint8_t *mem, const struct z80_bus *bus);
+
+/** Выполняет команды, пока такт кадра меньше end. HALT ожидает до end. */
+void z80_run(struct z80 *z, unsigned end);
+
+/**
+ * Запрашивает маскируемое прерывание (в начале кадра ZX-Spectrum).
+ * \return false, если прерывания запрещены.
+ */
+bool z80_interrupt(struct z80 *z);
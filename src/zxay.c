@@ -0,0 +1,195 @@
+/**\file
+ * \brief	Музыка ZX-Spectrum в формате AY (ZXAYEMUL) с исходными проигрывателями.
+ *
+ *  Память и регистры Z80 подготавливаются, как описано в формате: ПЗУ
+ *  заменяет заглушка, а по адресу 0 размещается цикл, вызывающий
+ *  инициализацию и затем обработчик прерывания в каждом кадре.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "z80.h"
+#include "zxay.h"
+
+/** Начальная композиция файла. */
+struct zxay_song {
+	/// Длительность, кадров (0 — не указана).
+	unsigned	frames;
+	uint8_t 	hi_reg;
+	uint8_t 	lo_reg;
+	uint16_t	stack;
+	uint16_t	init;
+	uint16_t	interrupt;
+	/// Смещение таблицы блоков памяти.
+	size_t  	blocks;
+};
+
+/** Обмен проигрывателя с AY через порты 0xFFFD (выбор регистра) и 0xBFFD (запись). */
+struct zxay_bus {
+	struct ay_regs	regs;
+	uint8_t       	reg;
+	/// Значения регистров для чтения из порта 0xFFFD.
+	uint8_t       	value[16];
+};
+
+static inline uint16_t be16(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+/** Относительный указатель: смещение со знаком от самого указателя. */
+static bool rel_ptr(const uint8_t *data, size_t size, size_t at, size_t need, size_t *to)
+{
+	if (at + 2 > size)
+		return false;
+	const long target = (long)at + (int16_t)be16(data + at);
+	if (target < 0 || (size_t)target + need > size)
+		return false;
+	*to = target;
+	return true;
+}
+
+static bool song_find(const uint8_t *data, size_t size, struct zxay_song *s)
+{
+	// Заголовок: сигнатура, версии, указатели на сведения, число композиций.
+	if (size < 20 || memcmp(data, "ZXAYEMUL", 8))
+		return false;
+	const unsigned first = data[17];
+	size_t songs, song, points;
+	if (first > data[16]
+	 || !rel_ptr(data, size, 18, 4 * (first + 1), &songs)
+	 || !rel_ptr(data, size, songs + 4 * first + 2, 14, &song)
+	 || !rel_ptr(data, size, song + 10, 6, &points)
+	 || !rel_ptr(data, size, song + 12, 2, &s->blocks))
+		return false;
+	s->frames    = be16(data + song + 4);
+	s->hi_reg    = data[song + 8];
+	s->lo_reg    = data[song + 9];
+	s->stack     = be16(data + points);
+	s->init      = be16(data + points + 2);
+	s->interrupt = be16(data + points + 4);
+	return true;
+}
+
+bool zxay_validate(const uint8_t *data, size_t size)
+{
+	struct zxay_song s;
+	return song_find(data, size, &s);
+}
+
+static uint8_t bus_in(void *ctx, uint16_t port)
+{
+	const struct zxay_bus *bus = ctx;
+	return (port & 0xC002) == 0xC000 && bus->reg < 16 ? bus->value[bus->reg] : 0xFF;
+}
+
+/**
+ * Запись в порт AY. Значения регистров снимаются в конце кадра: остаётся
+ * последнее записанное значение, а запись R13 перезапускает огибающую.
+ */
+static void bus_out(void *ctx, uint16_t port, uint8_t value)
+{
+	// Неиспользуемые разряды регистров читаются нулями.
+	static const uint8_t mask[16] = {
+		0xFF, 0x0F, 0xFF, 0x0F, 0xFF, 0x0F, 0x1F, 0xFF,
+		0x1F, 0x1F, 0x1F, 0xFF, 0xFF, 0x0F, 0xFF, 0xFF,
+	};
+	struct zxay_bus *bus = ctx;
+	if ((port & 0xC002) == 0xC000) {
+		bus->reg = value;
+	} else if ((port & 0xC002) == 0x8000 && bus->reg < 16) {
+		bus->value[bus->reg] = value & mask[bus->reg];
+		ay_regs_set(&bus->regs, bus->reg, value);
+	}
+}
+
+/** Загружает блоки памяти композиции из таблицы по смещению at. */
+static void load_blocks(const uint8_t *data, size_t size, size_t at, uint8_t *mem)
+{
+	for (; at + 6 <= size && be16(data + at); at += 6) {
+		const unsigned addr = be16(data + at);
+		size_t len = be16(data + at + 2), from;
+		if (!rel_ptr(data, size, at + 4, 0, &from))
+			continue;
+		// Блоки, выходящие за пределы памяти или файла, усекаются.
+		if (len > 0x10000 - addr)
+			len = 0x10000 - addr;
+		if (len > size - from)
+			len = size - from;
+		memcpy(mem + addr, data + from, len);
+	}
+}
+
+bool zxay_compile(const uint8_t *data, size_t size, struct ay_timeline *tl)
+{
+	struct zxay_song s;
+	if (!song_find(data, size, &s))
+		return false;
+	unsigned count = s.frames ? s.frames : zxay_default_frames;
+	uint8_t *mem = malloc(0x10000);
+	struct ay_regs *frames = malloc(count * sizeof(*frames));
+	unsigned *starts = malloc((count + zxay_pattern_frames - 1) / zxay_pattern_frames
+	                          * sizeof(*starts));
+	if (!mem || !frames || !starts) {
+		free(mem);
+		free(frames);
+		free(starts);
+		return false;
+	}
+	memset(mem, 0xC9, 0x100);
+	memset(mem + 0x100, 0xFF, 0x3F00);
+	memset(mem + 0x4000, 0x00, 0xC000);
+	mem[0x38] = 0xFB;
+	// Без адреса инициализации вызывается начало первого блока.
+	const uint16_t init = s.init ? s.init : be16(data + s.blocks);
+	if (s.interrupt) {
+		// DI; CALL init; loop: IM 1; EI; HALT; CALL interrupt; JR loop
+		const uint8_t boot[] = {
+			0xF3, 0xCD, init, init >> 8, 0xED, 0x56, 0xFB, 0x76,
+			0xCD, s.interrupt, s.interrupt >> 8, 0x18, 0xF7,
+		};
+		memcpy(mem, boot, sizeof(boot));
+	} else {
+		// Проигрыватель сам устанавливает обработчик прерывания IM 2.
+		// DI; CALL init; loop: IM 2; EI; HALT; JR loop
+		const uint8_t boot[] = {
+			0xF3, 0xCD, init, init >> 8, 0xED, 0x5E, 0xFB, 0x76, 0x18, 0xFA,
+		};
+		memcpy(mem, boot, sizeof(boot));
+	}
+	load_blocks(data, size, s.blocks, mem);
+
+	struct zxay_bus bus = { .regs.shape = ay_shape_keep };
+	struct z80 z;
+	z80_reset(&z, mem, &(struct z80_bus) { &bus, bus_in, bus_out });
+	for (unsigned n = 0; n < 12; ++n) {
+		// Пары располагаются старшим байтом вперёд, кроме AF (F, A).
+		const bool high = n == 7 || (n != 6 && !(n & 1));
+		z.r[n] = high ? s.hi_reg : s.lo_reg;
+	}
+	for (unsigned n = 0; n < 4; ++n)
+		z.alt[n] = s.hi_reg << 8 | s.lo_reg;
+	z.i  = 3;
+	z.sp = s.stack;
+	for (unsigned f = 0; f < count; ++f) {
+		z80_run(&z, z80_frame_tstates);
+		z.tstate -= z80_frame_tstates;
+		frames[f] = bus.regs;
+		bus.regs.shape = ay_shape_keep;
+		// Зациклившийся или слишком медленный проигрыватель усекает композицию.
+		if ((uint64_t)(f + 1) * z80_frame_tstates - z.idle > zxay_busy_tstates) {
+			count = f + 1;
+			break;
+		}
+		z80_interrupt(&z);
+	}
+	const unsigned patterns = (count + zxay_pattern_frames - 1) / zxay_pattern_frames;
+	for (unsigned p = 0; p < patterns; ++p)
+		starts[p] = p * zxay_pattern_frames;
+	const bool packed = ay_timeline_pack(tl, frames, count, 0, starts, patterns);
+	free(mem);
+	free(frames);
+	free(starts);
+	return packed;
+}
@@ -0,0 +1,41 @@
+/**\file
+ * \brief	Музыка ZX-Spectrum в формате AY (ZXAYEMUL) с исходными проигрывателями.
+ *
+ *  Файл AY содержит блоки памяти ZX-Spectrum — программу проигрывателя
+ *  и композицию — и адреса её инициализации и обработчика прерывания.
+ *  Программа выполняется интерпретатором Z80 по кадрам (1/50 сек), а её
+ *  записи в порты AY собираются в значения регистров, как у композиций CPS.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cps.h"
+
+enum {
+	/// Длительность композиции, если в файле она не указана, кадров (3 мин).
+	zxay_default_frames	= 3 * 60 * 50,
+	/// Длина шаблона для перехода по ay_music_seek(), кадров (5 сек).
+	zxay_pattern_frames	= 250,
+	/// Предел тактов работы проигрывателя без ожидания прерывания (около 5 мин Z80).
+	zxay_busy_tstates	= 1 << 30,
+};
+
+/** Проверяет заголовок файла AY размером size и описание начальной композиции. */
+bool zxay_validate(const uint8_t *data, size_t size);
+
+/**
+ * Выполняет проигрыватель начальной композиции файла AY в течение указанной
+ * в файле длительности и сохраняет значения регистров по кадрам. Композиция
+ * повторяется с начала.
+ * Регистры снимаются раз в кадр: такт записи внутри кадра не сохраняется,
+ * поэтому эффекты, меняющие регистры чаще 50 раз в секунду, теряются.
+ * Если проигрыватель занимает процессор дольше zxay_busy_tstates тактов,
+ * композиция усекается по последнему выполненному кадру.
+ * Массивы размещаются одним блоком, освобождаемым cps_timeline_free().
+ * \return false при ошибке в данных или нехватке памяти.
+ */
+bool zxay_compile(const uint8_t *data, size_t size, struct ay_timeline *tl);
@@ -0,0 +1,69 @@
+/**\file
+ * \brief	Компилятор композиций CPS в значения регистров AY по кадрам.
+ *
+ *  Выводит инициализатор struct ay_timeline для включения в исходный текст:
+ *  cpsc music/foxh.cps > music/foxh.cps.inl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cps.h"
+
+/** Выводит массив значений регистра (или номеров кадров) как составной литерал. */
+static void print_array(const char *type, const void *values, size_t size, unsigned frames)
+{
+	printf("\t\t(const %s[]){", type);
+	for (unsigned f = 0; f < frames; ++f) {
+		const unsigned v = size == 4 ? ((const unsigned*)values)[f]
+		                 : size == 2 ? ((const uint16_t*)values)[f]
+		                             : ((const uint8_t*)values)[f];
+		printf(f % 16 ? " 0x%0*x," : "\n\t\t\t0x%0*x,", (int)size * 2, v);
+	}
+	printf("\n\t\t},\n");
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2) {
+		fprintf(stderr, "Использование: %s композиция.cps\n", argv[0]);
+		return 1;
+	}
+	FILE *in = fopen(argv[1], "rb");
+	if (!in) {
+		perror(argv[1]);
+		return 1;
+	}
+	uint8_t data[0x10000];
+	const size_t size = fread(data, 1, sizeof(data), in);
+	fclose(in);
+	struct ay_timeline tl;
+	if (!size || !cps_compile(data, size, &tl)) {
+		fprintf(stderr, "Композиция %s не скомпилирована.\n", argv[1]);
+		return 2;
+	}
+
+	printf("// Сгенерировано %s из %s.\n{\n", argv[0], argv[1]);
+	printf("\t.frames     = %u,\n", tl.frames);
+	printf("\t.loop_frame = %u,\n", tl.loop_frame);
+	printf("\t.tone = {\n");
+	for (int cn = A; cn <= C; ++cn)
+		print_array("uint16_t", tl.tone[cn], sizeof(uint16_t), tl.frames);
+	printf("\t},\n\t.noise =\n");
+	print_array("uint8_t", tl.noise, sizeof(uint8_t), tl.frames);
+	printf("\t.mixer =\n");
+	print_array("uint8_t", tl.mixer, sizeof(uint8_t), tl.frames);
+	printf("\t.volume = {\n");
+	for (int cn = A; cn <= C; ++cn)
+		print_array("uint8_t", tl.volume[cn], sizeof(uint8_t), tl.frames);
+	printf("\t},\n\t.envelope =\n");
+	print_array("uint16_t", tl.envelope, sizeof(uint16_t), tl.frames);
+	printf("\t.shape =\n");
+	print_array("uint8_t", tl.shape, sizeof(uint8_t), tl.frames);
+	printf("\t.patterns = %u,\n", tl.patterns);
+	printf("\t.pattern_frame =\n");
+	print_array("unsigned", tl.pattern_frame, sizeof(unsigned), tl.patterns);
+	printf("}\n");
+	cps_timeline_free(&tl);
+	return 0;
+}